@@ -60,13 +60,22 @@ void tlb_write(uint32_t entryhi, uint32_t entrylo, uint32_t index);
 void tlb_read(uint32_t *entryhi, uint32_t *entrylo, uint32_t index);
 int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
+/*
+ * tlb_setentryhi: load ENTRYHI without touching the TLB. Translations
+ * only match entries whose TLBHI_PID is the one in ENTRYHI, and all the
+ * functions above overwrite it, so the current address space ID has to
+ * be put back afterwards.
+ */
+void tlb_setentryhi(uint32_t entryhi);
+
 /*
  * TLB entry fields.
  *
- * Note that the MIPS has support for a 6-bit address space ID. In the
- * interests of simplicity, we don't use it. The fields related to it
- * (TLBLO_GLOBAL and TLBHI_PID) can be left always zero, as can the
- * bits that aren't assigned a meaning.
+ * Note that the MIPS has support for a 6-bit address space ID, kept in
+ * TLBHI_PID. The VM system gives each address space one of them, so
+ * that the TLB doesn't have to be flushed on every context switch.
+ * TLBLO_GLOBAL is left zero, as are the bits that aren't assigned a
+ * meaning.
  *
  * The TLBLO_DIRTY bit is actually a write privilege bit - it is not
  * ever set by the processor. If you set it, writes are permitted. If
@@ -78,7 +87,8 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 /* Fields in the high-order word */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
+#define TLBHI_PIDSHIFT 6
 
 /* Fields in the low-order word */
 #define TLBLO_PPAGE   0xfffff000
@@ -101,5 +111,11 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 #define NUM_TLB  64
 
+/*
+ * Number of address space IDs that fit in TLBHI_PID.
+ */
+
+#define NUM_ASID 64
+
 
 #endif /* _MIPS_TLB_H_ */
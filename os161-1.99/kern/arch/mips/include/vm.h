@@ -114,6 +114,8 @@ struct tlbshootdown {
 	 */
 	struct addrspace *ts_addrspace;
 	vaddr_t ts_vaddr;
+	/* ASID of the entry, as of when the shootdown was sent */
+	unsigned ts_asid;
 };
 
 #define TLBSHOOTDOWN_MAX 16
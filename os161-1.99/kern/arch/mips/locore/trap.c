@@ -47,6 +47,10 @@
 #include <kern/wait.h>
 #endif /* OPT_A2 */
 
+#if OPT_A3
+#include <oom.h>
+#endif /* OPT_A3 */
+
 /* in exception.S */
 extern void asm_usermode(struct trapframe *tf);
 
@@ -114,6 +118,14 @@ kill_curthread(vaddr_t epc, unsigned code, vaddr_t vaddr)
 		break;
 	}
 
+#if OPT_A3
+	// A fault that failed because memory ran out and this process was
+	// picked to make room
+	if (oom_killed()) {
+		sig = SIGKILL;
+	}
+#endif /* OPT_A3 */
+
 	/*
 	 * You will probably want to change this.
 	 */
@@ -159,6 +171,14 @@ mips_trap(struct trapframe *tf)
 						+ STACK_SIZE));
 	}
 
+	/*
+	 * Remember the user stack pointer: faults in copyin/copyout grow
+	 * the stack relative to it (see as_grow_stack).
+	 */
+	if (!iskern && curthread != NULL) {
+		curthread->t_machdep.tm_usersp = tf->tf_sp;
+	}
+
 	/* Interrupt? Call the interrupt handler and return. */
 	if (code == EX_IRQ) {
 		int old_in;
@@ -242,22 +262,22 @@ mips_trap(struct trapframe *tf)
 	 */
 	switch (code) {
 	case EX_MOD:
-#if OPT_A3
-		kill_curthread(tf->tf_epc, code, tf->tf_vaddr);
-		goto done;
-#else
-		if (vm_fault(VM_FAULT_READONLY, tf->tf_vaddr)==0) {
+		// Pages are mapped read only until their first write (and while
+		// shared), vm_fault sorts out which it is
+		if (vm_fault(VM_FAULT_READONLY, tf->tf_vaddr,
+			     curthread->t_machdep.tm_usersp)==0) {
 			goto done;
 		}
 		break;
-#endif /* OPT-A3 */
 	case EX_TLBL:
-		if (vm_fault(VM_FAULT_READ, tf->tf_vaddr)==0) {
+		if (vm_fault(VM_FAULT_READ, tf->tf_vaddr,
+			     curthread->t_machdep.tm_usersp)==0) {
 			goto done;
 		}
 		break;
 	case EX_TLBS:
-		if (vm_fault(VM_FAULT_WRITE, tf->tf_vaddr)==0) {
+		if (vm_fault(VM_FAULT_WRITE, tf->tf_vaddr,
+			     curthread->t_machdep.tm_usersp)==0) {
 			goto done;
 		}
 		break;
@@ -330,6 +350,17 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+#if OPT_A3
+	/*
+	 * A process picked by the out-of-memory killer while it was in
+	 * the kernel (or running elsewhere) dies before it gets back to
+	 * user mode.
+	 */
+	if (!iskern && oom_killed()) {
+		sys__exit(SIGKILL, PROC_SIGNALLED);
+	}
+#endif /* OPT_A3 */
+
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
@@ -35,12 +35,17 @@
 #include <thread.h>
 #include <current.h>
 #include <syscall.h>
+#include <slab.h>
 
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 #if OPT_A2
 #include <kern/wait.h>
 #endif /* OPT_A2 */
+#if OPT_A3
+#include <copyinout.h>
+#endif /* OPT_A3 */
 
 /*
  * System call dispatcher.
@@ -167,6 +172,34 @@ syscall(struct trapframe *tf)
 
 #endif /* OPT_A2 */
 
+#if OPT_A3
+	case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, (vaddr_t*)(&retval));
+		break;
+	case SYS_mmap:
+	    {
+		// fd is the fifth argument, on the stack; the 64-bit offset
+		// after it is aligned to 8 bytes
+		int fd;
+		off_t offset;
+		err = copyin((const_userptr_t)(tf->tf_sp + 16), &fd, sizeof(fd));
+		if (err) break;
+		err = copyin((const_userptr_t)(tf->tf_sp + 24), &offset,
+				sizeof(offset));
+		if (err) break;
+		err = sys_mmap((vaddr_t)tf->tf_a0, (size_t)tf->tf_a1,
+				(int)tf->tf_a2, (int)tf->tf_a3, fd, offset,
+				(vaddr_t*)(&retval));
+	    }
+		break;
+	case SYS_munmap:
+		err = sys_munmap((vaddr_t)tf->tf_a0, (size_t)tf->tf_a1);
+		break;
+	case SYS_fsync:
+		err = sys_fsync((int)tf->tf_a0);
+		break;
+#endif /* OPT_A3 */
+
 	/* Add stuff here */
 
 	default:
@@ -219,7 +252,7 @@ enter_forked_process(struct trapframe *tf)
 	// going to user mode, can not use kernal whatever is kmalloc
 	struct trapframe tfOnStack;
 	memcpy(&tfOnStack,tf,sizeof(struct trapframe));
-	kfree(tf);
+	slab_free(&trapframe_cache, tf);
 	mips_usermode(&tfOnStack);
 #endif
 }
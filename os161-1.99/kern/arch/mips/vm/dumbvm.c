@@ -107,7 +107,7 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 }
 
 int
-vm_fault(int faulttype, vaddr_t faultaddress)
+vm_fault(int faulttype, vaddr_t faultaddress, vaddr_t stackptr)
 {
 	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
 	paddr_t paddr;
@@ -116,6 +116,9 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	struct addrspace *as;
 	int spl;
 
+	/* The stack doesn't grow */
+	(void)stackptr;
+
 	faultaddress &= PAGE_FRAME;
 
 	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
@@ -44,6 +44,11 @@
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
+#include <slab.h>
+
+/* Object cache for in-memory vnodes */
+static struct slab_cache sfs_vnode_cache =
+	SLAB_CACHE_INITIALIZER("sfs_vnode", sizeof(struct sfs_vnode), 0, NULL);
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
@@ -953,7 +958,7 @@ sfs_reclaim(struct vnode *v)
 	vfs_biglock_release();
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	slab_free(&sfs_vnode_cache, sv);
 
 	/* Done */
 	return 0;
@@ -1685,7 +1690,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = slab_alloc(&sfs_vnode_cache);
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -1699,7 +1704,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
-		kfree(sv);
+		slab_free(&sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -1736,7 +1741,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		slab_free(&sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -1747,7 +1752,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
 	if (result) {
 		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
+		slab_free(&sfs_vnode_cache, sv);
 		return result;
 	}
 
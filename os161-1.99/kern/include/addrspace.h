@@ -42,6 +42,21 @@
 
 struct vnode;
 
+#if OPT_A3
+// Entries in the software TLB of an address space (a power of two)
+#define AS_STLB_SIZE 64
+
+/*
+ * Software TLB entry: a page that faulted recently and where its page
+ * table entry is, so that the next refill can skip the segment lookups.
+ * A tag of 0 marks an empty entry (page 0 is never mapped).
+ */
+struct stlb_entry {
+	vaddr_t tag;
+	struct pte* pte;
+};
+#endif /* OPT_A3 */
+
 /*
  * Address space - data structure associated with the virtual memory
  * space of a process.
@@ -60,18 +75,61 @@ struct addrspace {
 	paddr_t as_stackpbase;
 #else
 
-	struct segment* text_seg;
-	struct segment* data_seg;
-	struct segment* stack_seg;
+	// the regions of the address space (see seg_find)
+	struct segment* as_segs;
+
+	// page table directory, with the second level tables covering the
+	// segments that have been touched (see pt_alloc)
+	struct pte ** as_pt;
 
-	// page table for three segments
-	struct pte * text_pt;
-	struct pte * data_pt;
-	struct pte * stack_pt;
+	// the heap segment (also on as_segs), and the break: the heap ends
+	// at the page that holds it (see as_sbrk)
+	struct segment* as_heap;
+	vaddr_t as_heap_end;
+
+	// the stack segment (also on as_segs), and the lowest address it
+	// may grow down to. The page below that is never mapped, so the
+	// heap can't grow up to it (see as_grow_stack).
+	struct segment* as_stack;
+	vaddr_t as_stack_floor;
 
 	// vnode for load pages
 	struct vnode* as_vn;
 
+	// next address space known to the coremap (see coremaps_as_register)
+	struct addrspace* as_next;
+
+	// TLB address space ID, the generation it is from, and the CPU it is
+	// used on (see tlb_activate)
+	unsigned as_asid;
+	unsigned as_asid_gen;
+	unsigned as_asid_cpu;
+
+	// direct mapped cache of page table entries (see vm_fault)
+	struct stlb_entry as_stlb[AS_STLB_SIZE];
+
+	// Residency, kept up to date by the coremap: the frames this address
+	// space owns, the most it has owned, and the most it may own before
+	// it has to replace its own pages (0 for no limit)
+	unsigned as_rss;
+	unsigned as_rss_peak;
+	unsigned as_rss_limit;
+
+	// working set estimate: the pages used during the last sampling
+	// interval, and those used so far in this one (sampled by the coremap)
+	unsigned as_ws;
+	unsigned as_ws_count;
+
+	// page faults (not TLB refills), the count at the last sample, and
+	// the rate over the last sampling interval (faults per second)
+	unsigned as_faults;
+	unsigned as_faults_sampled;
+	unsigned as_fault_rate;
+
+	// when the address space was created
+	time_t as_start_sec;
+	uint32_t as_start_nsec;
+
 #endif
 };
 
@@ -109,6 +167,26 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_sbrk   - move the break (the end of the heap) by AMOUNT bytes,
+ *                handing back the old one. The heap starts right after
+ *                the highest region of the executable.
+ *
+ *    as_grow_stack - extend the stack down to VADDR, if it can grow
+ *                that far and VADDR is close below the stack pointer
+ *                STACKPTR. Called on faults below the stack.
+ *
+ *    as_mmap   - map LEN bytes of a file, from OFFSET, into the address
+ *                space, near ADDR if that is free. Hands back where.
+ *
+ *    as_munmap - remove a whole file mapping, writing back its changes.
+ *                The mapping stays if the write back fails.
+ *
+ *    as_sync   - write back the changes to shared mappings of VN (of
+ *                every file if VN is NULL).
+ *
+ *    as_set_rss_limit - set the most frames new address spaces may have
+ *                before they replace their own pages (0 for no limit).
  */
 
 struct addrspace *as_create(void);
@@ -126,6 +204,20 @@ int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 void			  as_zero_region(paddr_t paddr, unsigned npages);
+#if OPT_A3
+void              as_stlb_flush(struct addrspace *as);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_grow_stack(struct addrspace *as, vaddr_t vaddr,
+                                vaddr_t stackptr);
+int               as_set_stack_limit(unsigned npages);
+void              as_set_rss_limit(unsigned npages);
+int               as_mmap(struct addrspace *as, struct vnode *vn,
+                          vaddr_t addr, size_t len, int prot, int flags,
+                          off_t offset, vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t addr, size_t len);
+int               as_sync(struct addrspace *as, struct vnode *vn);
+#endif
 
 /*
  * Functions in loadelf.c
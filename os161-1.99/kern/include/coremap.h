@@ -4,6 +4,8 @@
 #include <types.h>
 
 struct addrspace;
+struct vnode;
+struct segment;
 
 // entry in the coremap table
 struct coremap {
@@ -18,8 +20,39 @@ struct coremap {
 	vaddr_t cm_vaddr;
 	// indicate is the fram allocated or not
 	bool free;
+	// reference bit for the clock algorithm, set whenever the page
+	// is loaded into the TLB and cleared as the clock hand passes
+	bool referenced;
+	// number of page tables mapping this frame. More than one after a
+	// copy-on-write fork; all of them map it at cm_vaddr, and cm_as is
+	// one of them
+	unsigned int refcount;
+	// for text pages that can be shared by every process running the
+	// same program: the executable and the file offset of the page
+	// (cm_vn is NULL if the frame is not in the text cache)
+	struct vnode* cm_vn;
+	off_t cm_offset;
+	// next frame in the same text cache bucket, or -1
+	int cm_hnext;
+	// buddy allocator: if the frame starts a free block of 2^cm_order
+	// frames, its order and the other blocks of that order, else -1
+	int cm_order;
+	int cm_bnext;
+	int cm_bprev;
+	// contents in transit without coremaps_lock held: being loaded by a
+	// page fault, or written to swap by the pageout thread. A busy frame
+	// can't be evicted, freed or shared until it is done (cm_busy_cv).
+	bool busy;
+	// used since the working sets were last sampled
+	bool ws_referenced;
 };
 
+// Largest fault-around window, in pages
+#define CM_FAULTAROUND_MAX 16
+
+// Page replacement policies that can be used to choose a victim
+typedef enum { CM_POLICY_RR, CM_POLICY_CLOCK } cm_policy;
+
 /*
  * To initialize the lock for coremaps
  */
@@ -30,12 +63,39 @@ void coremaps_lock_init(void);
  */
 void coremaps_init(void);
 
+/*
+ * Start the pageout and zeroing threads (once the swap file is set up)
+ */
+void coremaps_pageout_start(void);
+
+/*
+ * Number of frames managed by the coremaps
+ */
+unsigned coremaps_nframes(void);
+
 /*
  * To get the pages from coremaps
  */
 paddr_t
 coremaps_getppages(size_t npages, struct addrspace* as, vaddr_t vaddr);
 
+/*
+ * Get a frame for the page at vaddr of as that is about to be loaded by
+ * a page fault. It is busy (pinned) until coremaps_fault_done: it can't
+ * be evicted, and nobody else can map it while it is half loaded.
+ */
+paddr_t
+coremaps_fault_alloc(struct addrspace* as, vaddr_t vaddr);
+
+/*
+ * Unpin the frame from coremaps_fault_alloc, and wake up everyone waiting
+ * for it. If it couldn't be loaded, it is freed and the page table entry
+ * that maps it is invalidated again (keeping its swap copy).
+ */
+void
+coremaps_fault_done(struct addrspace* as, vaddr_t vaddr, paddr_t paddr,
+		bool loaded);
+
 /*
  * To free a page in coremaps
  */
@@ -48,4 +108,163 @@ coremaps_free(paddr_t paddr);
 void
 coremaps_as_free(struct addrspace* as);
 
+/*
+ * Make an address space known to the coremap, so that frames it shares
+ * with other address spaces can be found (called by as_create)
+ */
+void
+coremaps_as_register(struct addrspace* as);
+
+/*
+ * Change the segments of an address space, with the lock held that the
+ * coremap walks them under. Removed segments can be freed afterwards.
+ */
+int
+coremaps_seg_add(struct addrspace* as, struct segment* seg);
+
+void
+coremaps_seg_remove(struct addrspace* as, struct segment* seg);
+
+void
+coremaps_seg_resize(struct segment* seg, vaddr_t vbase, vaddr_t vtop);
+
+/*
+ * Free the frames and swap slots of the pages from start up to end in
+ * as (which keeps running). Returns the number of pages freed.
+ */
+unsigned
+coremaps_as_release(struct addrspace* as, vaddr_t start, vaddr_t end);
+
+/*
+ * Share all resident and swapped pages of old with new (copy-on-write).
+ * new must have segments and page tables of the same size as old.
+ */
+void
+coremaps_as_copy(struct addrspace* old, struct addrspace* new);
+
+/*
+ * Return true if the frame at paddr is mapped by more than one page table
+ */
+bool
+coremaps_is_shared(paddr_t paddr);
+
+/*
+ * Give as a private copy of the shared frame mapped at vaddr
+ */
+int
+coremaps_cow(struct addrspace* as, vaddr_t vaddr);
+
+/*
+ * Map the shared zero frame read only at vaddr of as, unless the page is
+ * already there. Returns the frame the page is in.
+ */
+paddr_t
+coremaps_zero_share(struct addrspace* as, vaddr_t vaddr);
+
+/*
+ * Map the page at file offset `offset` of vn (program text or a shared
+ * file mapping) into as at vaddr, if some other process already has it
+ * loaded, at any address (waiting for it if it is still being loaded).
+ * Return true if the page table entry is now valid.
+ */
+bool
+coremaps_text_share(struct addrspace* as, vaddr_t vaddr, struct vnode* vn,
+		off_t offset);
+
+/*
+ * Let other processes share the page that is being loaded into the busy
+ * frame at paddr, from file offset `offset` of vn. Returns false if
+ * another frame has the page already (the caller should use that one
+ * instead, see coremaps_text_share).
+ */
+bool
+coremaps_text_publish(struct addrspace* as, vaddr_t vaddr, paddr_t paddr,
+		struct vnode* vn, off_t offset);
+
+/*
+ * Write the dirty pages of the shared file mapping seg of as back to
+ * its file.
+ */
+int
+coremaps_sync(struct addrspace* as, struct segment* seg);
+
+/*
+ * Write back the pages of vn between offset and offset + len that shared
+ * mappings have changed, before read(2) or write(2) get at the file
+ */
+int
+coremaps_file_sync(struct vnode* vn, off_t offset, size_t len);
+
+/*
+ * Make the shared mappings of vn reload the pages between offset and
+ * offset + len, after write(2) changed them
+ */
+void
+coremaps_file_written(struct vnode* vn, off_t offset, size_t len);
+
+/*
+ * Read the page at vaddr from swap into paddr, with readahead of the
+ * pages after it that were swapped out together with it
+ */
+int
+coremaps_swapin(struct addrspace* as, vaddr_t vaddr, paddr_t paddr,
+		uint32_t swap_offset);
+
+/*
+ * Read the page at vaddr from the executable into paddr, together with
+ * the following pages of the segment (fault-around)
+ */
+int
+coremaps_faultaround(struct addrspace* as, struct segment* seg,
+		vaddr_t vaddr, paddr_t paddr);
+
+/*
+ * Mark the frame at paddr as recently used (called on TLB refill)
+ */
+void
+coremaps_reference(paddr_t paddr);
+
+/*
+ * Print how the free frames are split up into buddy blocks
+ */
+void
+coremaps_print_frag(void);
+
+/*
+ * Print the resident set, peak, working set, swapped pages, faults and
+ * fault rate of a process (see the ps menu command)
+ */
+void
+coremaps_print_as(pid_t pid, const char* name, struct addrspace* as);
+
+/*
+ * Number of resident and swapped pages of as
+ */
+unsigned
+coremaps_as_usage(struct addrspace* as);
+
+/*
+ * Record the statistics of an exiting process, before its address space
+ * is destroyed, and print those of the last few that exited
+ */
+void
+coremaps_as_exit(pid_t pid, const char* name, struct addrspace* as);
+void
+coremaps_print_exited(void);
+
+/*
+ * Select the page replacement policy by name ("rr" or "clock").
+ * Return EINVAL if the name is not known.
+ */
+int
+coremaps_set_policy(const char* name);
+
+/*
+ * Set the fault-around window: the number of pages read from the
+ * executable on a text or data fault (1 turns fault-around off).
+ * Return EINVAL if it is not between 1 and CM_FAULTAROUND_MAX.
+ */
+int
+coremaps_set_faultaround(unsigned npages);
+
 #endif /* _COREMAP_H_ */
@@ -0,0 +1,21 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Definitions for mmap(), shared between the kernel and libc.
+ */
+
+/* Access to the mapped pages. Pages can always be read. */
+#define PROT_NONE      0
+#define PROT_READ      1
+#define PROT_WRITE     2
+#define PROT_EXEC      4
+
+/* Exactly one of these: writes go back to the file, or stay private. */
+#define MAP_SHARED     1
+#define MAP_PRIVATE    2
+
+/* Returned by mmap() on failure. */
+#define MAP_FAILED     ((void *)-1)
+
+#endif /* _KERN_MMAN_H_ */
@@ -0,0 +1,33 @@
+#ifndef _OOM_H_
+#define _OOM_H_
+
+#include "opt-A3.h"
+#if OPT_A3
+#include <types.h>
+
+/*
+ * Out-of-memory killer. When a page fault can't get a frame because
+ * memory and swap are both full, the process using the most of them
+ * (resident plus swapped pages) is killed, instead of the faulting
+ * process simply crashing. The victim exits with SIGKILL the next time
+ * it returns to user mode (see mips_trap).
+ */
+
+// Times the faulting process yields to let the victim die, before it
+// gives up and is killed itself
+#define OOM_WAIT_TRIES 100
+
+/*
+ * Called by a page fault that is out of memory. Picks a victim if none
+ * is dying yet and waits for it to go away. Returns true if the fault
+ * should be retried, false if the current process has to die instead.
+ */
+bool oom_kill(void);
+
+/*
+ * Return true if the current process was picked by the OOM killer
+ */
+bool oom_killed(void);
+#endif /* OPT_A3 */
+
+#endif /* _OOM_H_ */
@@ -40,6 +40,7 @@
 #include <thread.h> /* required for struct threadarray */
 
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 #if OPT_A2
 
@@ -53,6 +54,10 @@ struct procFH{
 	struct vnode* vn;
 };
 
+// Object cache the procFHs come from (see slab.h)
+struct slab_cache;
+extern struct slab_cache procFH_cache;
+
 #endif /* OPT_A2 */
 
 struct addrspace;
@@ -101,6 +106,12 @@ struct proc {
 #endif
 #endif /* OPT_A2 */
 
+#if OPT_A3
+	// picked by the out-of-memory killer: exits with SIGKILL on its way
+	// back to user mode (see oom.h)
+	bool p_oom_killed;
+#endif /* OPT_A3 */
+
 	/* add more material here as needed */
 };
 
@@ -142,5 +153,14 @@ struct addrspace *curproc_getas(void);
 /* Change the address space of the current process, and return the old one. */
 struct addrspace *curproc_setas(struct addrspace *);
 
+#if OPT_A3
+/*
+ * Take the address space away from the current process, to destroy it.
+ * Done with pidTableLock held, so that the address space of a process in
+ * pidTable stays valid for as long as somebody holds that lock.
+ */
+struct addrspace *curproc_detachas(void);
+#endif /* OPT_A3 */
+
 #endif /* _PROC_H_ */
 
@@ -8,18 +8,39 @@
 #include <vm.h>
 
 #define PT_VALID 0x00000200
+// page was written since it was loaded (same bit as TLBLO_DIRTY)
+#define PT_DIRTY 0x00000400
+// loaded ahead of time (readahead or fault-around), not used yet
+#define PT_PREFETCH 0x00000100
 
 #define PT_READ 0X00000080
 #define PT_WRITE 0x00000040
 #define PT_EXE 0x00000020
 
+// swap_offset of a page that has no copy in the swap file
+#define PT_NO_SWAP 0xffffffff
+
+// Page tables have two levels: 11 bits index the directory, 9 bits the
+// second level table, 12 bits are the page offset. With 8 byte entries
+// that makes each second level table exactly one page; the directory
+// only covers user space (below USERSPACETOP), so it is one page too.
+// Second level tables are only allocated once a page they cover is
+// touched.
+#define PT_L1_SHIFT 21
+#define PT_L2_SHIFT 12
+#define PT_L1_ENTRIES (USERSPACETOP >> PT_L1_SHIFT)
+#define PT_L2_ENTRIES 512
+#define PT_L1_INDEX(vaddr) ((vaddr) >> PT_L1_SHIFT)
+#define PT_L2_INDEX(vaddr) (((vaddr) >> PT_L2_SHIFT) & (PT_L2_ENTRIES - 1))
+
 //entry in the page table
 struct pte{
 	//frame number for the current page
 	paddr_t paddr;
-	//offset in swap file, 16 bits is enough since the swap file is 9MB maximum
-	//0xffff means not in swap file
-	uint16_t swap_offset;
+	//offset in swap file (in pages), PT_NO_SWAP means not in swap file
+	//a resident page keeps its slot while it is clean, so it can be
+	//evicted again without writing it out
+	uint32_t swap_offset;
 };
 
 /*
@@ -41,20 +62,40 @@ pt_setEntry(vaddr_t vaddr, paddr_t paddr);
  * use VOP_READ to load a page
  */
 int
-pt_loadPage(vaddr_t vaddr, paddr_t paddr, uint16_t swap_offset, struct addrspace *as, seg_type type);
+pt_loadPage(vaddr_t vaddr, paddr_t paddr, uint32_t swap_offset, struct addrspace *as, seg_type type);
 
 /*
- * Get the page table for this vaddr, or NULL if doesn't exist.
+ * Get a pointer to the page table entry for vaddr in as, or NULL if the
+ * address is not in any segment or its second level table doesn't exist
+ * yet. Never allocates, so it is safe with the coremap locked.
  */
 struct pte *
-get_pt(seg_type type, struct addrspace* as);
+pt_lookup(vaddr_t vaddr, struct addrspace* as);
+
+/*
+ * Like pt_lookup, but allocates the second level table if it is missing.
+ * Returns EFAULT if vaddr is not in any segment, ENOMEM if no table.
+ */
+int
+pt_alloc(vaddr_t vaddr, struct addrspace* as, struct pte** ret);
 
 /*
  * Invalid one entry in the page table
  */
-void pt_invalid(vaddr_t vaddr, struct addrspace* as, uint16_t swap_offset);
+void pt_invalid(vaddr_t vaddr, struct addrspace* as, uint32_t swap_offset);
 
-struct pte* create_pt(size_t npages, int flags);
+/*
+ * Create an empty page table directory, and free one with all of its
+ * second level tables.
+ */
+struct pte** pt_create(void);
+void pt_destroy(struct pte** pt);
+
+/*
+ * Give new a second level table wherever old has one (used by as_copy,
+ * so that coremaps_as_copy never has to allocate).
+ */
+int pt_copy_tables(struct addrspace* old, struct addrspace* new);
 #endif /* OPT-A3 */
 
 #endif /* _PT_H_ */
@@ -5,7 +5,13 @@
 #include <vm.h>
 #include <types.h>
 // Possible types of segments / virtual addresses
-typedef enum { TEXT, DATA, STACK } seg_type;
+typedef enum { TEXT, DATA, STACK, HEAP, MMAP } seg_type;
+
+// Segment flags (MMAP segments only)
+#define SEG_WRITE   0x1   // may be written
+#define SEG_SHARED  0x2   // writes go back to the file, not to swap
+
+struct vnode;
 
 struct segment {
 	off_t file_offset;
@@ -14,16 +20,43 @@ struct segment {
 	vaddr_t vtop;
 	seg_type type;
 	unsigned int npages;
+	// file the pages are loaded from, if any
+	struct vnode* vn;
+	unsigned flags;
+	// next segment of the address space
+	struct segment* next;
 };
 
 // Get the type of the vaddr, return error if invalid vaddr
 int get_seg_type(vaddr_t vaddr, struct addrspace* as, seg_type* seg);
 
-// Get the corresponding segment from the address space
-struct segment* get_segment(seg_type type, struct addrspace* as);
+// Get the segment that vaddr is in, or NULL if there is none
+struct segment* seg_find(struct addrspace* as, vaddr_t vaddr);
+
+// Add a segment to the address space, EINVAL if it overlaps another one
+int seg_add(struct addrspace* as, struct segment* seg);
+
+// Take a segment out of the address space (it is not freed)
+void seg_remove(struct addrspace* as, struct segment* seg);
+
+// Can the pages of the segment be written?
+bool seg_writeable(struct segment* seg);
+
+// Are the pages of the segment shared through the page cache?
+bool seg_cached(struct segment* seg);
+
+// Are dirty pages written back to the file (instead of swap)?
+bool seg_shared_file(struct segment* seg);
+
+// Does the page at vaddr start out as all zeros (nothing to load)?
+bool seg_demand_zero(struct segment* seg, vaddr_t vaddr);
 
 // Easy segment creation
 struct segment* seg_create(seg_type type, off_t offset, size_t filesz,
 		size_t memsz, vaddr_t vbase);
 
+// Object cache segments come from (see slab.h)
+struct slab_cache;
+extern struct slab_cache segment_cache;
+
 #endif /* _SEGMENTS_H_ */
@@ -0,0 +1,108 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include "opt-A3.h"
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <platform/maxcpus.h>
+
+/*
+ * Object caches (slab allocator), for kernel structures that are
+ * allocated and freed all the time. Each cache hands out objects of one
+ * size, carved out of pages of their own ("slabs"), and each CPU keeps a
+ * small magazine of freed objects so that most allocations and frees
+ * don't touch the cache's lock at all.
+ *
+ * Caches are defined statically with SLAB_CACHE_INITIALIZER, so they
+ * can be used as early as kmalloc can; they set themselves up on first
+ * use. A constructor, if given, is run once on each object when its
+ * slab is made, and objects are expected to be freed in the same state.
+ *
+ * Objects that fit at least two to a page share one-page slabs; bigger
+ * ones get pages of their own, and are only cached in the magazines.
+ */
+
+#if OPT_A3
+// Objects in each CPU's magazine (a quarter of that for objects with
+// pages of their own)
+#define SLAB_MAG_SIZE 8
+// Empty slabs a cache keeps rather than giving their pages back
+#define SLAB_KEEP_EMPTY 1
+
+struct slab;
+
+struct slab_magazine {
+	struct spinlock mag_lock;
+	unsigned mag_count;
+	void* mag_objs[SLAB_MAG_SIZE];
+	// allocations and frees served by the magazine
+	unsigned mag_hits;
+	unsigned mag_frees;
+};
+
+struct slab_cache {
+	const char* sc_name;
+	size_t sc_size;
+	size_t sc_align;
+	void (*sc_ctor)(void* obj);
+
+	// layout, worked out on first use: where the first object of a slab
+	// is, the distance between objects, where the free list link is kept
+	// in a free object, the objects per slab (0 for objects that have
+	// pages of their own) and pages per object in that case
+	bool sc_ready;
+	size_t sc_offset;
+	size_t sc_stride;
+	size_t sc_link;
+	unsigned sc_perslab;
+	unsigned sc_npages;
+
+	// protects the slabs and the counts below
+	struct spinlock sc_lock;
+	// slabs with free objects in them, and how many of those are empty
+	struct slab* sc_partial;
+	unsigned sc_nempty;
+	// slabs (or big objects) the cache has, and the allocations and
+	// frees that got past the magazines
+	unsigned sc_nslabs;
+	unsigned sc_allocs;
+	unsigned sc_frees;
+
+	// every cache that has been used, for slab_printstats
+	struct slab_cache* sc_next;
+
+	struct slab_magazine sc_mags[MAXCPUS];
+};
+
+#define SLAB_CACHE_INITIALIZER(name, size, align, ctor) \
+	{ .sc_name = (name), .sc_size = (size), .sc_align = (align), \
+	  .sc_ctor = (ctor), .sc_lock = SPINLOCK_INITIALIZER }
+
+/*
+ * Get an object from the cache, or NULL if out of memory
+ */
+void* slab_alloc(struct slab_cache* sc);
+
+/*
+ * Give an object back to the cache it came from
+ */
+void slab_free(struct slab_cache* sc, void* obj);
+
+/*
+ * Print the statistics of every cache (see the kh menu command)
+ */
+void slab_printstats(void);
+
+#else
+// Without A3 the caches are just kmalloc
+struct slab_cache {
+	size_t sc_size;
+};
+
+#define SLAB_CACHE_INITIALIZER(name, size, align, ctor) { (size) }
+#define slab_alloc(sc) kmalloc((sc)->sc_size)
+#define slab_free(sc, obj) kfree(obj)
+#endif /* OPT_A3 */
+
+#endif /* _SLAB_H_ */
@@ -6,25 +6,76 @@
 #include <types.h>
 #include <addrspace.h>
 
-// Size in bytes
+// Default size in bytes (can be changed at boot with swap_resize)
 #define SWAPFILE_SIZE 9*1024*1024
-// Number of pages in the file
+// Default number of pages in the file
 #define SWAPFILE_PAGES SWAPFILE_SIZE / PAGE_SIZE
 
 #define SWAPFILE_NAME "/SWAPFILE"
 
-void swap_free(uint16_t pageIndex);
+// Most pages moved to or from the swap file with a single write or read
+#define SWAP_CLUSTER 8
+
+void swap_free(uint32_t pageIndex);
+
+void swap_dup(uint32_t pageIndex);
 
 void swap_init(void);
 
 void swap_destroy(void);
 
-int swapin_mem(uint16_t pageIndex, paddr_t p_dest);
+/*
+	change the number of pages in the swap file
+	returns EBUSY if anything is swapped out already
+*/
+int swap_resize(unsigned npages);
+
+/*
+	swap to path instead of SWAPFILE_NAME: another file, or a raw disk
+	device (e.g. "lhd1raw:") that is used whole, bypassing the file
+	system. returns EBUSY if anything is swapped out already
+*/
+int swap_setdev(const char* path);
+
+/*
+	time writing npages pages to swap and reading them back, and print
+	the throughput (to compare the swap file with a raw device)
+*/
+int swap_bench(unsigned npages);
+
+int swapin_mem(uint32_t pageIndex, paddr_t p_dest);
+
+/*
+	read npages consecutive slots, starting at start, into paddrs
+*/
+int swapin_cluster(uint32_t start, const paddr_t* paddrs, unsigned npages);
 
 /*
 	return the offset in the swap file if success
+	ENOMEM if the swap file is full
+*/
+int swapout_mem(paddr_t paddr, uint32_t *swap_page);
+
+/*
+	swapout_mem in steps, so that the write can be done without holding
+	any locks: get a slot that only the caller refers to, write the page
+	to it, then drop the slot the page had before
+*/
+int swap_reserve(uint32_t old, uint32_t *pageIndex);
+int swap_write(uint32_t pageIndex, paddr_t paddr);
+void swap_replace(uint32_t old, uint32_t pageIndex);
+
+/*
+	write npages pages to one extent of the swap file, replacing the
+	slots in swap_pages. ENOMEM if there is no free extent that large
+*/
+int swapout_cluster(const paddr_t* paddrs, uint32_t* swap_pages, unsigned npages);
+
+/*
+	write a page straight to the swap file, bypassing the compressed
+	cache (see zswap.h), which uses it to make room
 */
-int swapout_mem(paddr_t paddr, uint16_t *swap_page);
+int swap_disk_write(uint32_t pageIndex, paddr_t paddr);
 #endif
 
 #endif
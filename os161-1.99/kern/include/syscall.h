@@ -31,6 +31,7 @@
 #define _SYSCALL_H_
 
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 struct trapframe; /* from <machine/trapframe.h> */
 
@@ -83,6 +84,18 @@ int sys_execv(userptr_t program, userptr_t args, int* retval);
 
 extern struct semaphore* file_sem;
 
+// Object cache the trapframe copies of sys_fork come from (see slab.h)
+struct slab_cache;
+extern struct slab_cache trapframe_cache;
+
 #endif /* OPT_A2 */
 
+#if OPT_A3
+int sys_sbrk(intptr_t amount, vaddr_t* retval);
+int sys_mmap(vaddr_t addr, size_t len, int prot, int flags, int fdesc,
+		off_t offset, vaddr_t* retval);
+int sys_munmap(vaddr_t addr, size_t len);
+int sys_fsync(int fdesc);
+#endif /* OPT_A3 */
+
 #endif /* _SYSCALL_H_ */
@@ -36,7 +36,37 @@
 #define VMSTAT_ELF_FILE_READ          (7)
 #define VMSTAT_SWAP_FILE_READ         (8)
 #define VMSTAT_SWAP_FILE_WRITE        (9)
-#define VMSTAT_COUNT                 (10)
+#define VMSTAT_COW_FAULT             (10)
+#define VMSTAT_TEXT_SHARED           (11)
+#define VMSTAT_SWAP_CLUSTER_WRITE    (12)
+#define VMSTAT_SWAP_CLUSTER_PAGE     (13)
+#define VMSTAT_SWAP_CLUSTER_READ     (14)
+#define VMSTAT_SWAP_READAHEAD        (15)
+#define VMSTAT_PAGEOUT_CLEAN         (16)
+#define VMSTAT_PAGEOUT_EVICT         (17)
+#define VMSTAT_FAULTAROUND           (18)
+#define VMSTAT_PREFETCH_USED         (19)
+#define VMSTAT_HEAP_FAULT            (20)
+#define VMSTAT_HEAP_RELEASE          (21)
+#define VMSTAT_MMAP_WRITEBACK        (22)
+#define VMSTAT_ZERO_PAGE_MAP         (23)
+#define VMSTAT_ZERO_PAGE_COPY        (24)
+#define VMSTAT_ZERO_POOL_HIT         (25)
+#define VMSTAT_ZERO_POOL_MISS        (26)
+#define VMSTAT_ZSWAP_STORE           (27)
+#define VMSTAT_ZSWAP_BYTES           (28)
+#define VMSTAT_ZSWAP_REJECT          (29)
+#define VMSTAT_ZSWAP_HIT             (30)
+#define VMSTAT_ZSWAP_MISS            (31)
+#define VMSTAT_ZSWAP_WRITEBACK       (32)
+#define VMSTAT_LOCAL_REPLACE         (33)
+#define VMSTAT_OOM_KILL              (34)
+#define VMSTAT_COMPACT_RUN           (35)
+#define VMSTAT_COMPACT_MIGRATE       (36)
+#define VMSTAT_COMPACT_FAIL          (37)
+#define VMSTAT_MMAP_LOST             (38)
+#define VMSTAT_TLB_SHOOTDOWN         (39)
+#define VMSTAT_COUNT                 (40)
 
 /* ----------------------------------------------------------------------- */
 
@@ -52,6 +82,10 @@ void _vmstats_init(void);                    /* atomicity must be ensured elsewh
 void vmstats_inc(unsigned int index);    /* uses locking */
 void _vmstats_inc(unsigned int index);   /* atomicity must be ensured elsewhere */
 
+/* Add amount to the specified count (for counts of bytes) */
+void vmstats_add(unsigned int index, unsigned int amount);    /* uses locking */
+void _vmstats_add(unsigned int index, unsigned int amount);   /* atomicity must be ensured elsewhere */
+
 /* Print the statistics: assumes that at least vmstats_init has been called */
 void vmstats_print(void);                    /* Does NOT use locking */
 
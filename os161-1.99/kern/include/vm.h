@@ -45,8 +45,13 @@
 #define VM_FAULT_READONLY    2    /* A write to a readonly page was attempted*/
 
 #if OPT_A3
-#define VM_STACKPAGES    12
-#define STACK_BASE USERSTACK - VM_STACKPAGES * PAGE_SIZE
+// Pages the user stack starts out with, and the default number it may
+// grow to (see as_set_stack_limit)
+#define VM_STACKPAGES    1
+#define VM_STACKLIMIT    256
+// How far below the stack pointer a fault may be and still grow the
+// stack; anything further down is a wild pointer
+#define VM_STACKGAP      (16 * PAGE_SIZE)
 
 paddr_t
 getppages(unsigned long npages);
@@ -54,14 +59,27 @@ getppages(unsigned long npages);
 void reset_next_victim(void);
 
 int tlb_insert(uint32_t tlb_hi, uint32_t tlb_lo);
+void tlb_update(uint32_t tlb_hi, uint32_t tlb_lo);
+
+struct addrspace;
+void tlb_invalidate(vaddr_t vaddr, struct addrspace* as);
+
+// Switch the TLB to the ASID of as (assigning one if needed)
+void tlb_activate(struct addrspace* as);
+// Drop all TLB entries of as
+void tlb_flush_as(struct addrspace* as);
 
 #endif /* OPT_A3 */
 
 /* Initialization function */
 void vm_bootstrap(void);
 
-/* Fault handling function called by trap code */
-int vm_fault(int faulttype, vaddr_t faultaddress);
+/*
+ * Fault handling function called by trap code. stackptr is the user
+ * stack pointer (as of the last trap from user mode, for faults in
+ * copyin/copyout).
+ */
+int vm_fault(int faulttype, vaddr_t faultaddress, vaddr_t stackptr);
 
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
 vaddr_t alloc_kpages(int npages);
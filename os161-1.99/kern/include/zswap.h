@@ -0,0 +1,53 @@
+#ifndef _ZSWAP_H_
+#define _ZSWAP_H_
+
+#include "opt-A3.h"
+#if OPT_A3
+#include <types.h>
+
+/*
+ * Compressed swap cache, in front of the swap file. A page written to a
+ * swap slot is compressed into a store of kernel frames first, and only
+ * goes to the swap file itself if it doesn't compress well enough. When
+ * the store is full, the pages that have been in it longest are written
+ * back to their slots in the swap file to make room.
+ */
+
+// Default size of the store, as a share of physical memory (1/n)
+#define ZSWAP_FRACTION 16
+
+// Pages that don't compress to this many bytes go to the swap file
+#define ZSWAP_MAX_SIZE (PAGE_SIZE * 3 / 4)
+
+/*
+ * Set up the store for a swap file of nslots slots. Panics if it can't.
+ */
+void zswap_init(unsigned nslots);
+
+/*
+ * Change the number of swap slots, or the number of frames in the store
+ * (0 turns it off). EBUSY if anything is in the store already.
+ */
+int zswap_set_slots(unsigned nslots);
+int zswap_resize(unsigned npages);
+
+/*
+ * Compress the page at paddr into the store as the contents of slot,
+ * replacing what it had for the slot before. Returns false if the page
+ * has to be written to the swap file instead.
+ */
+bool zswap_store(uint32_t slot, paddr_t paddr);
+
+/*
+ * Read the contents of slot into paddr, if the store has them. Returns
+ * false if they have to be read from the swap file.
+ */
+bool zswap_load(uint32_t slot, paddr_t paddr);
+
+/*
+ * Forget the contents of slot (it is free now)
+ */
+void zswap_invalidate(uint32_t slot);
+#endif /* OPT_A3 */
+
+#endif /* _ZSWAP_H_ */
@@ -120,6 +120,38 @@ bitmap_alloc(struct bitmap *b, unsigned *index)
         return ENOSPC;
 }
 
+/*
+ * Like bitmap_alloc, but start looking at bit START and wrap around
+ * (next fit). Callers that remember where the last allocation was
+ * avoid rescanning the full part of the map every time.
+ */
+int
+bitmap_alloc_from(struct bitmap *b, unsigned start, unsigned *index)
+{
+        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+        unsigned startix = (start < b->nbits) ? start / BITS_PER_WORD : 0;
+        unsigned i, ix, offset;
+
+        for (i=0; i<maxix; i++) {
+                ix = (startix + i) % maxix;
+                if (b->v[ix]==WORD_ALLBITS) {
+                        continue;
+                }
+                for (offset = 0; offset < BITS_PER_WORD; offset++) {
+                        WORD_TYPE mask = ((WORD_TYPE)1) << offset;
+
+                        if ((b->v[ix] & mask)==0) {
+                                b->v[ix] |= mask;
+                                *index = (ix*BITS_PER_WORD)+offset;
+                                KASSERT(*index < b->nbits);
+                                return 0;
+                        }
+                }
+                KASSERT(0);
+        }
+        return ENOSPC;
+}
+
 static
 inline
 void
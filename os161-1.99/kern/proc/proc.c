@@ -50,6 +50,7 @@
 #include <vfs.h>
 #include <synch.h>
 #include <kern/fcntl.h>
+#include <slab.h>
 
 #include "opt-A2.h"
 
@@ -64,7 +65,15 @@
 
 struct proc *kproc;
 
+/*
+ * Object caches for procs and their file handlers
+ */
+static struct slab_cache proc_cache =
+	SLAB_CACHE_INITIALIZER("proc", sizeof(struct proc), 0, NULL);
+
 #if OPT_A2
+struct slab_cache procFH_cache =
+	SLAB_CACHE_INITIALIZER("procFH", sizeof(struct procFH), 0, NULL);
 
 pid_t inc_pid(pid_t pid);
 
@@ -115,13 +124,13 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = slab_alloc(&proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		slab_free(&proc_cache, proc);
 		return NULL;
 	}
 
@@ -151,7 +160,7 @@ proc_create(const char *name)
 	// Semaphore used for `waitpid()`
 	proc->parentWait = sem_create("pwSem", 0);
 	if (proc->parentWait == NULL) {
-		kfree(proc);
+		slab_free(&proc_cache, proc);
 		return NULL;
 	}
 	proc->parent = NULL;
@@ -159,7 +168,7 @@ proc_create(const char *name)
 	proc->wait_rw_lock = rw_create("waitLock");
 	if (proc->wait_rw_lock == NULL) {
 		sem_destroy(proc->parentWait);
-		kfree(proc);
+		slab_free(&proc_cache, proc);
 		return NULL;
 	}
 #else
@@ -168,6 +177,10 @@ proc_create(const char *name)
 #endif // UW
 #endif /* OPT_A2 */
 
+#if OPT_A3
+	proc->p_oom_killed = false;
+#endif /* OPT_A3 */
+
 	return proc;
 }
 
@@ -224,12 +237,12 @@ proc_destroy(struct proc *proc)
 
 #if OPT_A2
 	// Close all open files and deallocate the file handlers
-	kfree(proc->file_arr[0]);
-	kfree(proc->file_arr[1]);
+	slab_free(&procFH_cache, proc->file_arr[0]);
+	slab_free(&procFH_cache, proc->file_arr[1]);
 	for (int i = 2; i < OPEN_MAX; ++i) {
 		if (proc->file_arr[i]) {
 			vfs_close(proc->file_arr[i]->vn);
-			kfree(proc->file_arr[i]);
+			slab_free(&procFH_cache, proc->file_arr[i]);
 			proc->file_arr[i] = NULL;
 		}
 	}
@@ -264,7 +277,7 @@ proc_destroy(struct proc *proc)
 	V(pidTableLock);
 #endif /* OPT-A2 */
 
-	kfree(proc);
+	slab_free(&proc_cache, proc);
 
 #ifdef UW
 	/* decrement the process count */
@@ -361,7 +374,7 @@ proc_create_runprogram(const char *name)
 
 	// Shorthand, because writing proc->file_arr a thousand times sucks
 	struct procFH** fa = proc->file_arr;
-	fa[0] = kmalloc(sizeof(struct procFH));
+	fa[0] = slab_alloc(&procFH_cache);
 	if (fa[0] == NULL) {
 		panic("unable to allocate memory for process file handler\n");
 	}
@@ -373,7 +386,7 @@ proc_create_runprogram(const char *name)
 	// The first 3 file handlers are all the same vnode and everything
 	for (int i = 0; i <= 2; ++i) {
 		// Malloc, but not for 0!
-		if (i) fa[i] = kmalloc(sizeof(struct procFH));
+		if (i) fa[i] = slab_alloc(&procFH_cache);
 
 		// This is trivially always false for 0, but to avoid having a
 		// nested if-statement, we just check anyway
@@ -531,3 +544,17 @@ curproc_setas(struct addrspace *newas)
 	return oldas;
 }
 
+#if OPT_A3
+/*
+ * Take the address space away from the current process (see proc.h)
+ */
+struct addrspace *
+curproc_detachas(void)
+{
+	P(pidTableLock);
+	struct addrspace *as = curproc_setas(NULL);
+	V(pidTableLock);
+	return as;
+}
+#endif /* OPT_A3 */
+
@@ -147,6 +147,8 @@ boot(void)
 #if OPT_A3
 	// Set up swapfile now that bootfs is up
 	swap_init();
+	// Page out (and zero free frames) in the background from now on
+	coremaps_pageout_start();
 #endif
 
 
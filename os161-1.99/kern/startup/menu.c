@@ -28,6 +28,7 @@
  */
 
 #include "opt-A2.h"
+#include "opt-A3.h"
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/reboot.h>
@@ -47,6 +48,14 @@
 #include "opt-sfs.h"
 #include "opt-net.h"
 
+#if OPT_A3
+#include <addrspace.h>
+#include <coremap.h>
+#include <swapfile.h>
+#include <zswap.h>
+#include <slab.h>
+#endif /* OPT_A3 */
+
 /*
  * In-kernel menu and command dispatcher.
  */
@@ -280,6 +289,226 @@ cmd_panic(int nargs, char **args)
 	return 0;
 }
 
+#if OPT_A3
+/*
+ * Command for choosing the page replacement policy. This is meant to
+ * be given on the kernel command line, e.g. "vmpolicy rr; p /testbin/huge".
+ */
+static
+int
+cmd_vmpolicy(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: vmpolicy rr|clock\n");
+		return EINVAL;
+	}
+
+	return coremaps_set_policy(args[1]);
+}
+
+/*
+ * Command for setting the size of the swap file in megabytes. Like
+ * vmpolicy, it has to run before anything gets swapped out.
+ */
+static
+int
+cmd_swapsize(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: swapsize megabytes\n");
+		return EINVAL;
+	}
+
+	int mb = atoi(args[1]);
+	if (mb <= 0 || mb > 2048) {
+		kprintf("swapsize: invalid size %s\n", args[1]);
+		return EINVAL;
+	}
+
+	return swap_resize(mb * (1024 * 1024 / PAGE_SIZE));
+}
+
+/*
+ * Command for swapping to a raw disk device (e.g. "swapdev lhd1raw:")
+ * or another file instead of the swap file. Has to run before anything
+ * gets swapped out too.
+ */
+static
+int
+cmd_swapdev(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: swapdev device:|path\n");
+		return EINVAL;
+	}
+
+	return swap_setdev(args[1]);
+}
+
+/*
+ * Command for timing page-out and page-in through the current swap
+ * backend (see swapdev).
+ */
+static
+int
+cmd_swapbench(int nargs, char **args)
+{
+	int npages = 256;
+	if (nargs > 2) {
+		kprintf("Usage: swapbench [pages]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		npages = atoi(args[1]);
+		if (npages <= 0) {
+			kprintf("swapbench: invalid number of pages %s\n", args[1]);
+			return EINVAL;
+		}
+	}
+
+	return swap_bench(npages);
+}
+
+/*
+ * Command for setting how many frames the compressed swap cache may use
+ * (0 turns it off). Also has to run before anything gets swapped out.
+ */
+static
+int
+cmd_zswap(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: zswap pages\n");
+		return EINVAL;
+	}
+
+	int npages = atoi(args[1]);
+	if (npages < 0 || (unsigned)npages > coremaps_nframes() / 2) {
+		kprintf("zswap: invalid size %s\n", args[1]);
+		return EINVAL;
+	}
+
+	return zswap_resize(npages);
+}
+
+/*
+ * Command for printing how fragmented free physical memory is.
+ */
+static
+int
+cmd_vmfrag(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	coremaps_print_frag();
+	return 0;
+}
+
+/*
+ * Command for setting the number of pages read from the executable
+ * on each text or data page fault (1 turns fault-around off).
+ */
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: faultaround pages\n");
+		return EINVAL;
+	}
+
+	int npages = atoi(args[1]);
+	if (npages < 1 || npages > CM_FAULTAROUND_MAX) {
+		kprintf("faultaround: window must be 1 to %d pages\n",
+			CM_FAULTAROUND_MAX);
+		return EINVAL;
+	}
+
+	return coremaps_set_faultaround(npages);
+}
+
+/*
+ * Command for setting how many pages the stacks of new processes may
+ * grow to.
+ */
+static
+int
+cmd_stacklimit(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: stacklimit pages\n");
+		return EINVAL;
+	}
+
+	int npages = atoi(args[1]);
+	if (npages < 1 || as_set_stack_limit(npages)) {
+		kprintf("stacklimit: invalid limit %s\n", args[1]);
+		return EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Command for setting how many frames new processes may have resident
+ * before they have to replace their own pages (0 for no limit).
+ */
+static
+int
+cmd_rsslimit(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: rsslimit pages\n");
+		return EINVAL;
+	}
+
+	int npages = atoi(args[1]);
+	if (npages < 0 || (unsigned)npages > coremaps_nframes()) {
+		kprintf("rsslimit: invalid limit %s\n", args[1]);
+		return EINVAL;
+	}
+
+	as_set_rss_limit(npages);
+	return 0;
+}
+
+/*
+ * Command for printing the memory use of every process. The menu waits
+ * for the programs it starts, so this mostly shows those that have just
+ * exited.
+ */
+static
+int
+cmd_ps(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kprintf("%5s %-16s %6s %6s %6s %6s %6s %7s\n", "PID", "NAME",
+		"RSS", "PEAK", "WS", "SWAP", "FAULTS", "FAULT/s");
+
+	P(pidTableLock);
+	for (pid_t pid = 0; pid <= PID_MAX; ++pid) {
+		struct proc *p = pidTable[pid];
+		if (p == NULL) continue;
+
+		// Processes that are done have no address space anymore. With
+		// pidTableLock held, nobody can destroy it while we look at it
+		// (see curproc_detachas).
+		spinlock_acquire(&p->p_lock);
+		struct addrspace *as = p->p_addrspace;
+		spinlock_release(&p->p_lock);
+		if (as == NULL) continue;
+
+		coremaps_print_as(pid, p->p_name, as);
+	}
+	V(pidTableLock);
+
+	coremaps_print_exited();
+	return 0;
+}
+#endif /* OPT_A3 */
+
 /*
  * Command for shutting down.
  */
@@ -399,6 +628,9 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+#if OPT_A3
+	slab_printstats();
+#endif /* OPT_A3 */
 	
 	return 0;
 }
@@ -443,6 +675,18 @@ static const char *opsmenu[] = {
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
 	"[panic]   Intentional panic         ",
+#if OPT_A3
+	"[vmpolicy] Page replacement policy  ",
+	"[swapsize] Set swap file size (MB)  ",
+	"[zswap]    Compressed swap (pages)  ",
+	"[swapdev]  Swap to device or file   ",
+	"[swapbench] Time swap I/O           ",
+	"[faultaround] Fault-around window   ",
+	"[stacklimit] Stack limit (pages)    ",
+	"[vmfrag]   Physical memory report   ",
+	"[rsslimit] Resident limit (pages)   ",
+	"[ps]       Process memory report    ",
+#endif /* OPT_A3 */
 	"[q]       Quit and shut down        ",
 	NULL
 };
@@ -552,6 +796,18 @@ static struct {
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
 	{ "panic",	cmd_panic },
+#if OPT_A3
+	{ "vmpolicy",	cmd_vmpolicy },
+	{ "swapsize",	cmd_swapsize },
+	{ "zswap",	cmd_zswap },
+	{ "swapdev",	cmd_swapdev },
+	{ "swapbench",	cmd_swapbench },
+	{ "faultaround", cmd_faultaround },
+	{ "stacklimit",	cmd_stacklimit },
+	{ "vmfrag",	cmd_vmfrag },
+	{ "rsslimit",	cmd_rsslimit },
+	{ "ps",		cmd_ps },
+#endif /* OPT_A3 */
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
 	{ "halt",	cmd_quit },
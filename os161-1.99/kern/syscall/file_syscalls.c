@@ -8,8 +8,13 @@
 #include <vfs.h>
 #include <current.h>
 #include <proc.h>
+#include <slab.h>
 
 #include "opt-A2.h"
+#include "opt-A3.h"
+#if OPT_A3
+#include <coremap.h>
+#endif
 
 #if OPT_A2
 int real_rw_flags(int flags);
@@ -173,7 +178,7 @@ sys_open(userptr_t filename, int flags, int* retval) {
 	}
 
 	// Allocate the new process file handler
-	struct procFH* new_proc_fh = kmalloc(sizeof(struct procFH));
+	struct procFH* new_proc_fh = slab_alloc(&procFH_cache);
 	if (new_proc_fh == NULL) {
 		// No memory for process fh
 		V(file_sem);
@@ -190,7 +195,7 @@ sys_open(userptr_t filename, int flags, int* retval) {
 		if (new_vnode_rw == NULL) {
 			// No memory for semaphore
 			V(file_sem);
-			kfree(new_proc_fh);
+			slab_free(&procFH_cache, new_proc_fh);
 			return EMFILE;
 		}
 
@@ -199,7 +204,7 @@ sys_open(userptr_t filename, int flags, int* retval) {
 		if (new_sys_fh == NULL) {
 			// No memory for system fh
 			V(file_sem);
-			kfree(new_proc_fh);
+			slab_free(&procFH_cache, new_proc_fh);
 			rw_destroy(new_vnode_rw);
 			return EMFILE;
 		}
@@ -263,7 +268,7 @@ sys_close(int fd) {
 	curproc->file_arr[fd]->vn = NULL;
 
 	// Free procFH
-	kfree(curproc->file_arr[fd]);
+	slab_free(&procFH_cache, curproc->file_arr[fd]);
 	curproc->file_arr[fd] = NULL;
 
 	//if close the file that only opened by one process
@@ -337,6 +342,15 @@ sys_read(int fdesc, userptr_t ubuf, unsigned int nbytes, int* retval) {
   u.uio_rw = UIO_READ; // from kernel to uio_seg
   u.uio_space = curproc->p_addrspace;
 
+#if OPT_A3
+  // Pick up what shared mappings of the file have written
+  res = coremaps_file_sync(curproc->file_arr[fdesc]->vn, u.uio_offset, nbytes);
+  if (res) {
+	rw_signal(sys_fh->rwlock,(RoW)0);
+	return res;
+  }
+#endif
+
   res = VOP_READ(curproc->file_arr[fdesc]->vn,&u);
   if(res){
 	rw_signal(sys_fh->rwlock,(RoW)0); // release the lock
@@ -417,8 +431,23 @@ sys_write(int fdesc, userptr_t ubuf, unsigned int nbytes, int *retval)
   u.uio_rw = UIO_WRITE;
   u.uio_space = curproc->p_addrspace;
 
+#if OPT_A3
+  // Shared mappings of the file go to it first, so that what we write
+  // comes last, and see the new contents afterwards
+  res = coremaps_file_sync(curproc->file_arr[fdesc]->vn, u.uio_offset, nbytes);
+  if (res) {
+    rw_signal(sys_fh->rwlock,(RoW)1);
+    return res;
+  }
+#endif
+
   res = VOP_WRITE(curproc->file_arr[fdesc]->vn, &u);
 
+#if OPT_A3
+  coremaps_file_written(curproc->file_arr[fdesc]->vn, p_fh->offset,
+    nbytes - u.uio_resid);
+#endif
+
   if (res) {
     rw_signal(sys_fh->rwlock,(RoW)1);
     return res;
@@ -436,3 +465,86 @@ sys_write(int fdesc, userptr_t ubuf, unsigned int nbytes, int *retval)
 
   return 0;
 }
+
+#if OPT_A3
+#include <addrspace.h>
+#include <kern/mman.h>
+
+/*
+ * Look up the vnode behind fdesc, checking it has the permissions in
+ * need. The mapping or sync that follows holds its own reference, so
+ * file_sem is not kept.
+ */
+static
+int
+file_lookup_vnode(int fdesc, int need, struct vnode** ret)
+{
+  if ((fdesc <= STDERR_FILENO) || (fdesc >= OPEN_MAX)) {
+    return EBADF;
+  }
+
+  P(file_sem);
+  struct procFH* p_fh = curproc->file_arr[fdesc];
+  if (p_fh == NULL || (p_fh->flags & need) != need) {
+	  V(file_sem);
+	  return EBADF;
+  }
+  *ret = p_fh->vn;
+  V(file_sem);
+  return 0;
+}
+
+/*
+ * handler for mmap() system call
+ */
+int
+sys_mmap(vaddr_t addr, size_t len, int prot, int flags, int fdesc,
+		off_t offset, vaddr_t* retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: mmap(%x,%d,%d,%d,%d)\n",addr,len,prot,flags,fdesc);
+
+  // Shared writable mappings write to the file, so need it open for writing
+  int need = CAN_READ;
+  if ((prot & PROT_WRITE) && (flags == MAP_SHARED)) need |= CAN_WRITE;
+
+  struct vnode* vn;
+  int res = file_lookup_vnode(fdesc, need, &vn);
+  if (res) return res;
+
+  KASSERT(curproc->p_addrspace != NULL);
+  return as_mmap(curproc->p_addrspace, vn, addr, len, prot, flags, offset,
+		retval);
+}
+
+/*
+ * handler for munmap() system call
+ */
+int
+sys_munmap(vaddr_t addr, size_t len)
+{
+  DEBUG(DB_SYSCALL,"Syscall: munmap(%x,%d)\n",addr,len);
+
+  KASSERT(curproc->p_addrspace != NULL);
+  return as_munmap(curproc->p_addrspace, addr, len);
+}
+
+/*
+ * handler for fsync() system call: write back this process's changes
+ * to shared mappings of the file, then flush the file itself
+ */
+int
+sys_fsync(int fdesc)
+{
+  DEBUG(DB_SYSCALL,"Syscall: fsync(%d)\n",fdesc);
+
+  struct vnode* vn;
+  int res = file_lookup_vnode(fdesc, 0, &vn);
+  if (res) return res;
+
+  KASSERT(curproc->p_addrspace != NULL);
+  res = as_sync(curproc->p_addrspace, vn);
+  if (res) return res;
+
+  return VOP_FSYNC(vn);
+}
+#endif /* OPT_A3 */
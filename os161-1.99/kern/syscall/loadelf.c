@@ -86,7 +86,7 @@
 
 #if OPT_A3
 /*
-save the vnode and offset and filesize for pagetable 1 and 2
+save the vnode and offset and filesize for the segment at vaddr
 because we need those for page fault later
 */
 static
@@ -104,20 +104,17 @@ prepare_segment(struct addrspace *as, struct vnode *v,
 		as->as_vn = v;
 	}
 
-	if (as->text_seg == NULL) {
-		as->text_seg = seg_create(TEXT, offset, filesize, memsize, vaddr);
-		return 0;
-	}
-	if (as->data_seg == NULL) {
-		as->data_seg = seg_create(DATA, offset, filesize, memsize, vaddr);
-		return 0;
-	}
+	// Nothing to load for an empty region
+	if (memsize == 0) return 0;
 
-	/*
-	 * Support for more than two regions is not available.
-	 */
-	kprintf("vm: Warning: too many regions\n");
-	return EUNIMP;
+	// as_define_region set it up
+	struct segment* seg = seg_find(as, vaddr & PAGE_FRAME);
+	if (seg == NULL) return EINVAL;
+
+	seg->file_offset = offset;
+	seg->filesize = filesize;
+	seg->vn = v;
+	return 0;
 }
 #endif
 
@@ -9,6 +9,7 @@
 #include <addrspace.h>
 
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 #if OPT_A2
 #include <vnode.h>
@@ -27,6 +28,17 @@ void entry(void* data1, unsigned long data2);
 
 #endif /* OPT_A2 */
 
+#if OPT_A3
+#include <coremap.h>
+#endif /* OPT_A3 */
+#include <slab.h>
+
+#if OPT_A2
+// Object cache for the trapframe copies handed to forked children
+struct slab_cache trapframe_cache =
+	SLAB_CACHE_INITIALIZER("trapframe", sizeof(struct trapframe), 0, NULL);
+#endif /* OPT_A2 */
+
 void sys__exit(int exitcode, int flag) {
 
   struct addrspace *as;
@@ -53,7 +65,9 @@ void sys__exit(int exitcode, int flag) {
 	else {
 		curproc->exitCode = _MKWAIT_SIG(exitcode);
 	}
+	spinlock_acquire(&curproc->p_lock);
 	curproc->isDone = true;
+	spinlock_release(&curproc->p_lock);
 
 	//signal the wait
 	V(p->parentWait);
@@ -69,7 +83,15 @@ void sys__exit(int exitcode, int flag) {
    * half-destroyed address space. This tends to be
    * messily fatal.
    */
+#if OPT_A3
+  as = curproc_detachas();
+#else
   as = curproc_setas(NULL);
+#endif /* OPT_A3 */
+#if OPT_A3
+  // Keep its memory statistics for the ps menu command
+  coremaps_as_exit(curproc->pid, curproc->p_name, as);
+#endif /* OPT_A3 */
   as_destroy(as);
 
   /* detach this thread from its process */
@@ -134,11 +156,11 @@ sys_fork(pid_t* retval,struct trapframe *tf) {
 		proc_destroy(child);
 		return result;
 	}
-	//make a copy of tf in kernal space kmalloc
+	//make a copy of tf in kernal space (trapframe_cache)
 	//parent need the original for return value
 	//copy
 
-	struct trapframe* new_tf = kmalloc(sizeof(struct trapframe));
+	struct trapframe* new_tf = slab_alloc(&trapframe_cache);
 	if(new_tf == NULL){
 		proc_destroy(child);
 		return ENOMEM;
@@ -153,9 +175,9 @@ sys_fork(pid_t* retval,struct trapframe *tf) {
 	for (int i = 3; i < __OPEN_MAX; ++i) {
 		if(curproc->file_arr[i]!=NULL){
 			//full copy
-			child->file_arr[i] = kmalloc(sizeof(struct procFH));
+			child->file_arr[i] = slab_alloc(&procFH_cache);
 			if(child->file_arr[i] == NULL){
-				kfree(new_tf);
+				slab_free(&trapframe_cache, new_tf);
 				proc_destroy(child);
 				return ENOMEM;
 			}
@@ -171,7 +193,7 @@ sys_fork(pid_t* retval,struct trapframe *tf) {
 	result = thread_fork("child_p_thread",child,&entry,new_tf,0); // second argument...
 
 	if(result){
-		kfree(new_tf);
+		slab_free(&trapframe_cache, new_tf);
 		// need double check as_destroy(addrspace)
 		// should clean the file array for us: see proc.c
 		proc_destroy(child);
@@ -345,8 +367,12 @@ int sys_execv(userptr_t user_prog_name, userptr_t user_args, int* retval) {
 		strcpy(argv[i], arg);
 	}
 
+#if OPT_A3
+	as_destroy(curproc_detachas());
+#else
 	as_destroy(curproc->p_addrspace);
 	curproc->p_addrspace = NULL;
+#endif /* OPT_A3 */
 
 	// execute the program
 	// Can we leave args and name on the stack?
@@ -363,3 +389,12 @@ int sys_execv(userptr_t user_prog_name, userptr_t user_args, int* retval) {
 
 #endif /* OPT_A2 */
 
+#if OPT_A3
+int
+sys_sbrk(intptr_t amount, vaddr_t* retval) {
+	struct addrspace* as = curproc_getas();
+	if (as == NULL) return ENOMEM;
+
+	return as_sbrk(as, amount, retval);
+}
+#endif /* OPT_A3 */
@@ -34,6 +34,7 @@
  */
 
 #include "opt-A2.h"
+#include "opt-A3.h"
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
@@ -106,6 +107,20 @@ runprogram(char *progname)
 	}
 
 #if OPT_A2
+#if OPT_A3
+	// The arguments are written below the stack pointer from the
+	// kernel, and faults there only grow the stack close to the user's
+	// stack pointer: make room for them up front
+	size_t argsize = sizeof(char*) * (nargs + 1) + 8;
+	for (unsigned long i = 0; i < nargs; i++) {
+		argsize += ROUNDUP(strlen(args[i]) + 1, 4);
+	}
+	vaddr_t argbase = stackptr - argsize;
+	if (argbase < as->as_stack->vbase) {
+		result = as_grow_stack(as, argbase, argbase);
+		if (result) return E2BIG;
+	}
+#endif /* OPT_A3 */
         unsigned long argc = nargs;
         stackptr -= stackptr % 4;
         stackptr -= sizeof(char*) * (nargs + 1);
@@ -50,6 +50,7 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <slab.h>
 
 #include "opt-synchprobs.h"
 
@@ -57,6 +58,12 @@
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/* Object caches for thread structures and their stacks. */
+static struct slab_cache thread_cache =
+	SLAB_CACHE_INITIALIZER("thread", sizeof(struct thread), 0, NULL);
+static struct slab_cache stack_cache =
+	SLAB_CACHE_INITIALIZER("stack", STACK_SIZE, 0, NULL);
+
 /* Wait channel. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -123,14 +130,14 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = slab_alloc(&thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		slab_free(&thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -214,7 +221,7 @@ cpu_create(unsigned hardware_number)
 		/*c->c_curthread->t_stack = ... */
 	}
 	else {
-		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
+		c->c_curthread->t_stack = slab_alloc(&stack_cache);
 		if (c->c_curthread->t_stack == NULL) {
 			panic("cpu_create: couldn't allocate stack");
 		}
@@ -250,7 +257,7 @@ thread_destroy(struct thread *thread)
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
 	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
+		slab_free(&stack_cache, thread->t_stack);
 	}
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
@@ -259,7 +266,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	slab_free(&thread_cache, thread);
 }
 
 /*
@@ -489,7 +496,7 @@ thread_fork(const char *name,
 	}
 
 	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
+	newthread->t_stack = slab_alloc(&stack_cache);
 	if (newthread->t_stack == NULL) {
 		thread_destroy(newthread);
 		return ENOMEM;
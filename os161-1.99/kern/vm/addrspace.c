@@ -45,7 +45,22 @@
 #include <uw-vmstats.h>
 #include <pt.h>
 #include <vfs.h>
+#include <vnode.h>
 #include <coremap.h>
+#include <stat.h>
+#include <kern/mman.h>
+#include <clock.h>
+#include <slab.h>
+
+// Pages the stack of a new process may grow to
+static unsigned as_stack_limit = VM_STACKLIMIT;
+
+// Resident frames a new process may have (0 for no limit)
+static unsigned as_rss_limit = 0;
+
+// Object cache for address spaces (segments have theirs in segments.c)
+static struct slab_cache addrspace_cache =
+	SLAB_CACHE_INITIALIZER("addrspace", sizeof(struct addrspace), 0, NULL);
 
 void
 as_zero_region(paddr_t paddr, unsigned npages)
@@ -53,6 +68,34 @@ as_zero_region(paddr_t paddr, unsigned npages)
         bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
 }
 
+/*
+ * Give a copy of every segment of old to a new address space (used by
+ * as_copy). They end up in reverse order, which makes no difference.
+ */
+static
+int
+as_copy_segments(struct addrspace* old, struct addrspace* new)
+{
+	for (struct segment* oldseg = old->as_segs; oldseg != NULL;
+			oldseg = oldseg->next) {
+		struct segment* seg = slab_alloc(&segment_cache);
+		if (seg == NULL) return ENOMEM;
+		*seg = *oldseg;
+		seg->next = NULL;
+		// File mappings hold a reference to their file
+		if (seg->type == MMAP) VOP_INCREF(seg->vn);
+		if (oldseg == old->as_heap) new->as_heap = seg;
+		if (oldseg == old->as_stack) new->as_stack = seg;
+
+		// Can't overlap, they don't in old
+		int result = coremaps_seg_add(new, seg);
+		KASSERT(result == 0);
+	}
+	new->as_heap_end = old->as_heap_end;
+	new->as_stack_floor = old->as_stack_floor;
+	return 0;
+}
+
 
 #endif /* OPT-A3 */
 /*
@@ -67,24 +110,53 @@ as_create(void)
 
 	#if OPT_A3
 
-	struct addrspace *as = kmalloc(sizeof(struct addrspace));
+	struct addrspace *as = slab_alloc(&addrspace_cache);
 	if (as == NULL) {
 		return NULL;
 	}
 
 	// Segments
-	as->text_seg = NULL;
-	as->data_seg = NULL;
-	as->stack_seg = NULL;
+	as->as_segs = NULL;
 
 	//page table
-	as->text_pt = NULL;
-	as->data_pt = NULL;
-	as->stack_pt = NULL;
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		slab_free(&addrspace_cache, as);
+		return NULL;
+	}
+
+	// Set up once the executable is loaded
+	as->as_heap = NULL;
+	as->as_heap_end = 0;
+	as->as_stack = NULL;
+	as->as_stack_floor = USERSTACK;
 
 	//vnode
 	as->as_vn = NULL;
 
+	// Gets an ASID the first time it runs
+	as->as_asid = 0;
+	as->as_asid_gen = 0;
+	as->as_asid_cpu = 0;
+
+	// Nothing cached in the software TLB yet
+	as_stlb_flush(as);
+
+	// Nothing resident or used yet
+	as->as_rss = 0;
+	as->as_rss_peak = 0;
+	as->as_rss_limit = as_rss_limit;
+	as->as_ws = 0;
+	as->as_ws_count = 0;
+	as->as_faults = 0;
+	as->as_faults_sampled = 0;
+	as->as_fault_rate = 0;
+	gettime(&as->as_start_sec, &as->as_start_nsec);
+
+	// Let the coremap find us when we share frames with another process
+	as->as_next = NULL;
+	coremaps_as_register(as);
+
 	return as;
 
 	#else
@@ -103,6 +175,21 @@ as_create(void)
 	#endif /* OPT-A3 */
 }
 
+#if OPT_A3
+/*
+ * Empty the software TLB of as. Needed whenever page table entries move
+ * or go away while the address space is still in use.
+ */
+void
+as_stlb_flush(struct addrspace *as)
+{
+	for (unsigned i = 0; i < AS_STLB_SIZE; i++) {
+		as->as_stlb[i].tag = 0;
+		as->as_stlb[i].pte = NULL;
+	}
+}
+#endif /* OPT_A3 */
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -115,22 +202,27 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		return ENOMEM;
 	}
 
-	// TODO
+	// Both address spaces load pages from the same executable
+	new->as_vn = old->as_vn;
+	if (new->as_vn != NULL) {
+		VOP_INCOPEN(new->as_vn);
+		VOP_INCREF(new->as_vn);
+	}
 
-	/* (Mis)use as_prepare_load to allocate some physical memory. */
-	if (as_prepare_load(new)) {
+	// Same segments, with the same second level tables (the entries are
+	// filled in by coremaps_as_copy)
+	int result = as_copy_segments(old, new);
+	if (!result) {
+		result = pt_copy_tables(old, new);
+	}
+	if (result) {
 		as_destroy(new);
-		return ENOMEM;
+		return result;
 	}
 
-	//copy the vnode and page table in the address space
-	// TODO: increment references
-	new->as_vn = old->as_vn;
-	//new->text_pt = kmalloc(sizeof(paddr_t) * new->as_npages1);
-	//new->data_pt = kmalloc(sizeof(paddr_t) * new->as_npages2);
-	//new->stack_pt = NULL; // TODO: Do we kmalloc here?
-
-	//Do the deep copy? what about stack? use memmove?
+	// Share the frames and swap slots instead of copying them. Both
+	// sides get a private copy of a page when they first write to it.
+	coremaps_as_copy(old, new);
 
 	*ret = new;
 	return 0;
@@ -155,21 +247,27 @@ as_destroy(struct addrspace *as)
 {
 
 	#if OPT_A3
-	// Close the vnode (this was opened at runtime by runprogram)
-	vfs_close(as->as_vn);
+	// Changes to shared file mappings go back to their files
+	for (struct segment* seg = as->as_segs; seg != NULL; seg = seg->next) {
+		if (seg_shared_file(seg)) coremaps_sync(as, seg);
+	}
 
 	//free all used physical memory
 	coremaps_as_free(as);
 
-	// Paranoia: Check all sub-elements
-	if (as->text_seg != NULL) kfree(as->text_seg);
-	if (as->data_seg != NULL) kfree(as->data_seg);
-	if (as->stack_seg != NULL) kfree(as->stack_seg);
+	// Close the vnode (this was opened at runtime by runprogram). Only
+	// now: its pages may be in the text cache until they are freed.
+	if (as->as_vn != NULL) vfs_close(as->as_vn);
 
-	if (as->text_pt != NULL) kfree(as->text_pt);
-	if (as->data_pt != NULL) kfree(as->data_pt);
-	if (as->stack_pt != NULL) kfree(as->stack_pt);
-	kfree(as);
+	while (as->as_segs != NULL) {
+		struct segment* seg = as->as_segs;
+		as->as_segs = seg->next;
+		if (seg->type == MMAP) VOP_DECREF(seg->vn);
+		slab_free(&segment_cache, seg);
+	}
+
+	pt_destroy(as->as_pt);
+	slab_free(&addrspace_cache, as);
 
 	#else
 	kfree(as);
@@ -191,10 +289,9 @@ as_activate(void)
 			return;
 	}
 
-	vm_tlbshootdown_all();
-	
-	vmstats_inc(VMSTAT_TLB_INVALIDATE);
-	reset_next_victim();
+	// The TLB keeps the entries of other address spaces (they are
+	// tagged with their ASIDs), we just switch to ours
+	tlb_activate(as);
 
 	#else
 	struct addrspace *as;
@@ -238,47 +335,23 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 {
 
 	#if OPT_A3
-	// Set up the flags that we will be using
-	int flags = 0;
-	if (readable) flags |= PT_READ;
-	if (writeable) flags |= PT_WRITE;
-	if (executable) flags |= PT_EXE;
-
-	/* Align the region. First, the base... */
-	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
-	vaddr &= PAGE_FRAME;
-
-	/* ...and now the length. */
-	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
-
-	size_t npages = sz / PAGE_SIZE;
-
-	if (as->text_pt == NULL) {
-		// Space for page table
-		as->text_pt = create_pt(npages, flags);
-		if (as->text_pt == NULL) return ENOMEM;
+	(void)readable;
+	(void)executable;
 
-		return 0;
-	}
+	if (sz == 0) return 0;
 
-	if (as->data_pt == NULL) {
-		// Space for page table
-		as->data_pt = create_pt(npages, flags);
-		if (as->data_pt == NULL) return ENOMEM;
+	// Writeable regions hold data, the others are loaded from the ELF
+	// file and can be shared. No page table space is needed until the
+	// region is touched. The file offsets are filled in by load_elf.
+	struct segment* seg = seg_create(writeable ? DATA : TEXT, 0, 0, sz, vaddr);
+	if (seg == NULL) return ENOMEM;
 
-		// Initialize the page table
-		for(size_t i = 0; i < npages; i++){
-			as->data_pt[i].paddr = flags;
-			as->data_pt[i].swap_offset = 0xffff;
-		}
-		return 0;
+	int result = coremaps_seg_add(as, seg);
+	if (result) {
+		slab_free(&segment_cache, seg);
+		return result;
 	}
-
-	/*
-	 * Support for more than two regions is not available.
-	 */
-	kprintf("dumbvm: Warning: too many regions\n");
-	return EUNIMP;
+	return 0;
 
 	#else
 	(void)as;
@@ -313,11 +386,22 @@ as_complete_load(struct addrspace *as)
 {
 
 	#if OPT_A3
-	/*
-	 * Write this.
-	 */
+	// The heap starts out empty, on the page after the last region
+	vaddr_t base = 0;
+	for (struct segment* seg = as->as_segs; seg != NULL; seg = seg->next) {
+		if (seg->vtop > base) base = seg->vtop;
+	}
 
-	(void)as;
+	struct segment* heap = seg_create(HEAP, 0, 0, 0, base);
+	if (heap == NULL) return ENOMEM;
+
+	int result = coremaps_seg_add(as, heap);
+	if (result) {
+		slab_free(&segment_cache, heap);
+		return result;
+	}
+	as->as_heap = heap;
+	as->as_heap_end = base;
 	return 0;
 
 	#else
@@ -330,22 +414,34 @@ int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
 	#if OPT_A3
-	as->stack_pt = create_pt(VM_STACKPAGES, 0);
-	if (as->stack_pt == NULL) return ENOMEM;
-
-	as->stack_seg = kmalloc(sizeof(struct segment));
-	if (as->stack_seg == NULL) return ENOMEM;
-
 	// Initialize a special "segment". Note that this isn't really
 	// a segment, because it doesn't live in the ELF file.
 	// However, treating it as such simplifies a bunch of code nicely,
 	// so we will do that.
-	as->stack_seg->type = STACK;
-	as->stack_seg->filesize = 0;
-	as->stack_seg->file_offset = 0;
-	as->stack_seg->vtop = USERSTACK;
-	as->stack_seg->vbase = STACK_BASE;
-	as->stack_seg->npages = VM_STACKPAGES;
+	// It starts small and grows down on faults (see as_grow_stack)
+	struct segment* stack = seg_create(STACK, 0, 0,
+			VM_STACKPAGES * PAGE_SIZE,
+			USERSTACK - VM_STACKPAGES * PAGE_SIZE);
+	if (stack == NULL) return ENOMEM;
+
+	int result = coremaps_seg_add(as, stack);
+	if (result) {
+		slab_free(&segment_cache, stack);
+		return result;
+	}
+
+	// Up to the limit, but with a guard page above the highest region
+	// (the heap may grow up to the guard page, but not into it)
+	vaddr_t floor = USERSTACK - as_stack_limit * PAGE_SIZE;
+	vaddr_t top = 0;
+	for (struct segment* seg = as->as_segs; seg != NULL; seg = seg->next) {
+		if (seg != stack && seg->vtop > top) top = seg->vtop;
+	}
+	if (floor < top + PAGE_SIZE) floor = top + PAGE_SIZE;
+	if (floor > stack->vbase) floor = stack->vbase;
+
+	as->as_stack = stack;
+	as->as_stack_floor = floor;
 
 	*stackptr = USERSTACK;
 	return 0;
@@ -360,3 +456,245 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	#endif
 }
 
+#if OPT_A3
+/*
+ * Extend the stack of as down to the page holding vaddr. Returns EFAULT
+ * if that is below the stack floor: past the limit, or on the guard page
+ * (a stack overflow), or more than VM_STACKGAP below the stack pointer
+ * (not a stack access at all).
+ */
+int
+as_grow_stack(struct addrspace *as, vaddr_t vaddr, vaddr_t stackptr)
+{
+	struct segment* stack = as->as_stack;
+	if (stack == NULL) return EFAULT;
+
+	if (vaddr < stackptr && stackptr - vaddr > VM_STACKGAP) return EFAULT;
+
+	vaddr &= PAGE_FRAME;
+	if (vaddr >= stack->vbase || vaddr < as->as_stack_floor) return EFAULT;
+
+	// Page table space is only allocated for the pages that get touched
+	coremaps_seg_resize(stack, vaddr, stack->vtop);
+	return 0;
+}
+
+/*
+ * Set the number of pages that the stacks of new processes may grow to.
+ */
+int
+as_set_stack_limit(unsigned npages)
+{
+	if (npages < VM_STACKPAGES || npages > USERSTACK / PAGE_SIZE / 2) {
+		return EINVAL;
+	}
+	as_stack_limit = npages;
+	return 0;
+}
+
+/*
+ * Set the number of frames that new processes may have resident before
+ * they have to replace their own pages (0 for no limit).
+ */
+void
+as_set_rss_limit(unsigned npages)
+{
+	as_rss_limit = npages;
+}
+
+/*
+ * Return true if [vaddr, vaddr+len) is free for a file mapping: clear of
+ * every segment, and of the space the stack may grow into.
+ */
+static
+bool
+as_mmap_fits(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	if (vaddr == 0 || len > as->as_stack_floor - PAGE_SIZE ||
+			vaddr > as->as_stack_floor - PAGE_SIZE - len) {
+		return false;
+	}
+	for (struct segment* seg = as->as_segs; seg != NULL; seg = seg->next) {
+		if (seg->vbase < vaddr + len && vaddr < seg->vtop) return false;
+	}
+	return true;
+}
+
+/*
+ * Find room for a file mapping of len bytes: the highest gap below the
+ * stack's guard page, working down towards the heap. Returns 0 if there
+ * is none.
+ */
+static
+vaddr_t
+as_mmap_place(struct addrspace *as, size_t len)
+{
+	vaddr_t top = as->as_stack_floor - PAGE_SIZE;
+	vaddr_t bottom = (as->as_heap != NULL) ? as->as_heap->vtop : PAGE_SIZE;
+
+	while (top >= bottom && top - bottom >= len) {
+		vaddr_t base = top - len;
+		struct segment* hit = NULL;
+		for (struct segment* seg = as->as_segs; seg != NULL;
+				seg = seg->next) {
+			if (seg->vbase < top && base < seg->vtop) {
+				hit = seg;
+				break;
+			}
+		}
+		if (hit == NULL) return base;
+		// Try again below whatever is in the way
+		top = hit->vbase;
+	}
+	return 0;
+}
+
+/*
+ * Map len bytes of vn, starting at offset, into as. The pages are loaded
+ * from the file when they are first touched. With MAP_SHARED, writes go
+ * back to the file (on munmap, fsync, exit, or when the page is evicted)
+ * and the frames are shared through the page cache; with MAP_PRIVATE,
+ * written pages become private and go to swap like the data segment.
+ * addr is only a hint. The address used is handed back in ret.
+ */
+int
+as_mmap(struct addrspace *as, struct vnode *vn, vaddr_t addr, size_t len,
+		int prot, int flags, off_t offset, vaddr_t *ret)
+{
+	if (len == 0 || offset < 0 || (offset & ~(off_t)PAGE_FRAME) != 0) {
+		return EINVAL;
+	}
+	if (flags != MAP_SHARED && flags != MAP_PRIVATE) return EINVAL;
+
+	struct stat st;
+	int result = VOP_STAT(vn, &st);
+	if (result) return result;
+
+	// Pages past the end of the file are zero filled
+	size_t filesize = 0;
+	if (offset < st.st_size) {
+		off_t left = st.st_size - offset;
+		filesize = (left < (off_t)len) ? (size_t)left : len;
+	}
+
+	if (len > USERSPACETOP) return ENOMEM;
+	len = (len + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	vaddr_t base = addr & PAGE_FRAME;
+	if (base != addr || !as_mmap_fits(as, base, len)) {
+		base = as_mmap_place(as, len);
+		if (base == 0) return ENOMEM;
+	}
+
+	struct segment* seg = seg_create(MMAP, offset, filesize, len, base);
+	if (seg == NULL) return ENOMEM;
+	seg->vn = vn;
+	if (prot & PROT_WRITE) seg->flags |= SEG_WRITE;
+	if (flags == MAP_SHARED) seg->flags |= SEG_SHARED;
+
+	result = coremaps_seg_add(as, seg);
+	if (result) {
+		slab_free(&segment_cache, seg);
+		return result;
+	}
+	// Keeps the file around after it is closed
+	VOP_INCREF(vn);
+
+	*ret = base;
+	return 0;
+}
+
+/*
+ * Remove the file mapping at addr from as. Only whole mappings can be
+ * unmapped. Dirty pages of shared mappings are written back first; if
+ * that fails the mapping is left in place and the error is returned.
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	struct segment* seg = seg_find(as, addr);
+	if (seg == NULL || seg->type != MMAP || seg->vbase != addr) return EINVAL;
+	if (len == 0 || len > seg->vtop - seg->vbase ||
+			((len + PAGE_SIZE - 1) & PAGE_FRAME) != seg->vtop - seg->vbase) {
+		return EINVAL;
+	}
+
+	if (seg_shared_file(seg)) {
+		// Keep the mapping if its changes could not all be written back
+		int result = coremaps_sync(as, seg);
+		if (result) return result;
+	}
+
+	// Still part of the address space while the pages are released
+	coremaps_as_release(as, seg->vbase, seg->vtop);
+	coremaps_seg_remove(as, seg);
+
+	VOP_DECREF(seg->vn);
+	slab_free(&segment_cache, seg);
+	return 0;
+}
+
+/*
+ * Write back the changes made to shared mappings of vn in as (for
+ * fsync), or to all of its shared mappings if vn is NULL.
+ */
+int
+as_sync(struct addrspace *as, struct vnode *vn)
+{
+	int result = 0;
+	for (struct segment* seg = as->as_segs; seg != NULL; seg = seg->next) {
+		if (!seg_shared_file(seg) || (vn != NULL && seg->vn != vn)) continue;
+
+		int err = coremaps_sync(as, seg);
+		if (err && result == 0) result = err;
+	}
+	return result;
+}
+
+/*
+ * Move the break of as by amount bytes, and hand back the old one. The
+ * heap segment covers the pages up to the one holding the break: new
+ * pages are zero filled on demand, and the frames and swap slots of the
+ * pages it gives up are freed right away.
+ */
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	struct segment* heap = as->as_heap;
+	if (heap == NULL) return ENOMEM;
+
+	vaddr_t old = as->as_heap_end;
+	if (amount < 0 && (vaddr_t)-amount > old - heap->vbase) return EINVAL;
+	if (amount > 0 && (vaddr_t)amount > USERSPACETOP - old) return ENOMEM;
+
+	vaddr_t end = old + amount;
+	vaddr_t top = (end + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	if (top > heap->vtop) {
+		// Leave the stack room to grow, with the guard page below it
+		if (as->as_stack != NULL && top > as->as_stack_floor - PAGE_SIZE) {
+			return ENOMEM;
+		}
+		// And don't run into anything else that is mapped
+		for (struct segment* seg = as->as_segs; seg != NULL;
+				seg = seg->next) {
+			if (seg != heap && seg->vbase < top && heap->vtop < seg->vtop) {
+				return ENOMEM;
+			}
+		}
+	}
+	else if (top < heap->vtop) {
+		// Still part of the segment while they are released
+		unsigned released = coremaps_as_release(as, top, heap->vtop);
+		for (unsigned i = 0; i < released; ++i) {
+			vmstats_inc(VMSTAT_HEAP_RELEASE);
+		}
+	}
+
+	coremaps_seg_resize(heap, heap->vbase, top);
+	as->as_heap_end = end;
+
+	*oldbreak = old;
+	return 0;
+}
+#endif /* OPT_A3 */
@@ -8,6 +8,15 @@
 #include <segments.h>
 #include <synch.h>
 #include <swapfile.h>
+#include <kern/errno.h>
+#include <thread.h>
+#include <current.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <platform/maxcpus.h>
+#include <uio.h>
+#include <vnode.h>
+#include <clock.h>
 
 static paddr_t coremaps_base;
 static paddr_t coremaps_end;
@@ -15,17 +24,357 @@ static unsigned int cm_npages;
 
 static struct coremap* coremaps;
 
+// victims to try when evicting fails because the swap file is full
+#define CM_EVICT_TRIES 32
+
 // lock for the coremaps, solve the synchronization problem
 static struct lock* coremaps_lock = NULL;
 
-// simple page replacement alogrithm (TODO)
+// page replacement policy used to choose victims (see coremaps_set_policy)
+static cm_policy policy = CM_POLICY_CLOCK;
+
+// next frame to look at, shared by both policies (the "clock hand")
 static size_t next_victim = 0;
-static size_t cm_get_victim(void){
-	size_t victim;
 
-	victim = next_victim;
-	next_victim = (next_victim + 1) % cm_npages;
-	return victim;
+// all user address spaces, so that every mapping of a shared frame
+// can be found (protected by coremaps_lock)
+static struct addrspace* cm_as_list = NULL;
+
+// number of free frames
+static size_t cm_nfree = 0;
+
+// Per-CPU caches ("magazines") of free frames, so that most single page
+// allocations and kernel page frees don't need coremaps_lock. A frame in
+// a magazine is not free in the map: it looks like a kernel page.
+#define CM_MAG_SIZE 16
+// frames moved between a magazine and the map at a time
+#define CM_MAG_BATCH 8
+
+struct cm_magazine {
+	struct spinlock mag_lock;
+	unsigned mag_count;
+	size_t mag_frames[CM_MAG_SIZE];
+};
+static struct cm_magazine cm_magazines[MAXCPUS];
+
+// Pool of free frames that are zeroed already, so that most single page
+// allocations don't have to zero one. It is filled in the background by
+// the zeroing thread, from frames nobody is short of. Like the frames in
+// the magazines, they are out of the map.
+#define CM_ZPOOL_SIZE 32
+// the zeroing thread is woken up when the pool gets down to this many
+#define CM_ZPOOL_LOW 8
+static struct spinlock cm_zpool_lock = SPINLOCK_INITIALIZER;
+static unsigned cm_zpool_count = 0;
+static size_t cm_zpool_frames[CM_ZPOOL_SIZE];
+// the zeroing thread is waiting on cm_zpool_sem
+static bool cm_zpool_asleep = false;
+static struct semaphore* cm_zpool_sem = NULL;
+
+// Buddy system over the free frames: each free frame is in exactly one
+// block of 2^k frames (aligned to 2^k) on the list for order k. The
+// lists are threaded through cm_bnext/cm_bprev of the first frames.
+#define CM_BUDDY_ORDERS 16
+static int cm_buddy_heads[CM_BUDDY_ORDERS];
+
+// the pageout thread is woken up when there are fewer than cm_low_water
+// free frames, and makes room until there are cm_high_water of them
+static size_t cm_low_water;
+static size_t cm_high_water;
+static struct cv* cm_pageout_cv = NULL;
+
+// pages read from the executable on a text or data fault, including the
+// one that faulted (see coremaps_set_faultaround)
+static unsigned cm_faultaround = 4;
+
+// signalled when a frame stops being busy
+static struct cv* cm_busy_cv = NULL;
+
+// page cache: frames holding program text or pages of shared file
+// mappings, hashed by (vnode, offset) and chained through cm_hnext
+// (protected by coremaps_lock)
+#define CM_TEXT_BUCKETS 64
+static int cm_text_hash[CM_TEXT_BUCKETS];
+
+// protects the resident counts of the address spaces (as_rss), which
+// change whenever a frame changes hands, with or without coremaps_lock
+static struct spinlock cm_rss_lock = SPINLOCK_INITIALIZER;
+
+// hand for choosing which of its own pages an address space replaces
+static size_t cm_local_hand = 0;
+
+// seconds between samples of the working sets (see cm_ws_thread)
+#define CM_WS_INTERVAL 1
+
+// the last few processes that exited, for coremaps_print_exited
+#define CM_EXITED_MAX 8
+struct cm_exited {
+	pid_t pid;
+	char name[16];
+	unsigned rss;
+	unsigned rss_peak;
+	unsigned swapped;
+	unsigned faults;
+	// how long it ran, in milliseconds
+	uint32_t msecs;
+};
+static struct cm_exited cm_exited[CM_EXITED_MAX];
+static unsigned cm_nexited = 0;
+
+// A frame of zeros, mapped read only by every page that has only been
+// read since it was created (see coremaps_zero_share). It belongs to the
+// kernel, which holds one reference so that it is never freed.
+static paddr_t cm_zero_paddr = 0;
+
+/*
+ * Index of the frame at paddr in the coremaps
+ */
+static
+size_t
+cm_index(paddr_t paddr) {
+	KASSERT(paddr >= coremaps_base);
+	size_t index = (paddr - coremaps_base) / PAGE_SIZE;
+	KASSERT(index < cm_npages);
+	return index;
+}
+
+/*
+ * Bucket of the text cache for page `offset` of vn
+ */
+static
+unsigned
+cm_text_bucket(struct vnode* vn, off_t offset) {
+	return ((uintptr_t)vn / sizeof(void*) + (uint32_t)offset / PAGE_SIZE)
+		% CM_TEXT_BUCKETS;
+}
+
+/*
+ * Find the frame caching page `offset` of vn, or return -1
+ */
+static
+int
+cm_text_find(struct vnode* vn, off_t offset) {
+	int idx = cm_text_hash[cm_text_bucket(vn, offset)];
+	while (idx != -1 && (coremaps[idx].cm_vn != vn ||
+				coremaps[idx].cm_offset != offset)) {
+		idx = coremaps[idx].cm_hnext;
+	}
+	return idx;
+}
+
+/*
+ * Add frame idx to the text cache as page `offset` of vn
+ */
+static
+void
+cm_text_insert(size_t idx, struct vnode* vn, off_t offset) {
+	unsigned bucket = cm_text_bucket(vn, offset);
+	coremaps[idx].cm_vn = vn;
+	coremaps[idx].cm_offset = offset;
+	coremaps[idx].cm_hnext = cm_text_hash[bucket];
+	cm_text_hash[bucket] = idx;
+}
+
+/*
+ * Take frame idx out of the text cache, if it is in it
+ */
+static
+void
+cm_text_remove(size_t idx) {
+	struct coremap* page = coremaps + idx;
+	if (page->cm_vn == NULL) return;
+
+	int* link = &cm_text_hash[cm_text_bucket(page->cm_vn, page->cm_offset)];
+	while (*link != (int)idx) {
+		KASSERT(*link != -1);
+		link = &coremaps[*link].cm_hnext;
+	}
+	*link = page->cm_hnext;
+
+	page->cm_vn = NULL;
+	page->cm_offset = 0;
+	page->cm_hnext = -1;
+}
+
+/*
+ * Return true if the page table entry maps the frame at paddr
+ */
+static
+bool
+cm_maps(struct pte* pte, paddr_t paddr) {
+	return pte != NULL && (pte->paddr & PT_VALID) &&
+		(pte->paddr & PAGE_FRAME) == paddr;
+}
+
+/*
+ * Find the page table entry through which as maps frame idx, and the
+ * vaddr it is mapped at, or return NULL. A frame in the text cache is
+ * found through the segments of as that map its part of the file, so it
+ * can be at a different address in each sharer; any other frame is only
+ * shared after a fork, at the same vaddr everywhere. An address space
+ * maps a frame at most once.
+ */
+static
+struct pte*
+cm_map_lookup(size_t idx, struct addrspace* as, vaddr_t* vaddr) {
+	struct coremap* page = coremaps + idx;
+	paddr_t paddr = coremaps_base + (PAGE_SIZE*idx);
+
+	if (page->cm_vn == NULL) {
+		struct pte* pte = pt_lookup(page->cm_vaddr, as);
+		*vaddr = page->cm_vaddr;
+		return cm_maps(pte, paddr) ? pte : NULL;
+	}
+
+	for (struct segment* seg = as->as_segs; seg != NULL; seg = seg->next) {
+		if (!seg_cached(seg) || seg->vn != page->cm_vn ||
+				page->cm_offset < seg->file_offset) {
+			continue;
+		}
+		off_t seg_offset = page->cm_offset - seg->file_offset;
+		if (seg_offset >= (off_t)(seg->vtop - seg->vbase)) continue;
+
+		struct pte* pte = pt_lookup(seg->vbase + seg_offset, as);
+		if (cm_maps(pte, paddr)) {
+			*vaddr = seg->vbase + seg_offset;
+			return pte;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Make as the owner of the frame (NULL for the kernel, or a free frame),
+ * keeping the resident counts of both address spaces up to date
+ */
+static
+void
+cm_set_owner(struct coremap* page, struct addrspace* as) {
+	spinlock_acquire(&cm_rss_lock);
+	if (page->cm_as != NULL) {
+		KASSERT(page->cm_as->as_rss > 0);
+		page->cm_as->as_rss -= 1;
+	}
+	if (as != NULL) {
+		as->as_rss += 1;
+		if (as->as_rss > as->as_rss_peak) as->as_rss_peak = as->as_rss;
+	}
+	page->cm_as = as;
+	spinlock_release(&cm_rss_lock);
+}
+
+/*
+ * Return true if as has as many frames as it may have (see
+ * as_set_rss_limit), so that it has to replace its own pages
+ */
+static
+bool
+cm_over_limit(struct addrspace* as) {
+	return as != NULL && as->as_rss_limit != 0 &&
+		as->as_rss >= as->as_rss_limit;
+}
+
+/*
+ * Put the free block of 2^order frames at idx on its list
+ */
+static
+void
+cm_buddy_insert(size_t idx, unsigned order) {
+	struct coremap* page = coremaps + idx;
+	page->cm_order = order;
+	page->cm_bprev = -1;
+	page->cm_bnext = cm_buddy_heads[order];
+	if (page->cm_bnext != -1) coremaps[page->cm_bnext].cm_bprev = idx;
+	cm_buddy_heads[order] = idx;
+}
+
+/*
+ * Take the free block at idx off its list
+ */
+static
+void
+cm_buddy_remove(size_t idx) {
+	struct coremap* page = coremaps + idx;
+	KASSERT(page->cm_order >= 0);
+
+	if (page->cm_bprev != -1) {
+		coremaps[page->cm_bprev].cm_bnext = page->cm_bnext;
+	}
+	else {
+		cm_buddy_heads[page->cm_order] = page->cm_bnext;
+	}
+	if (page->cm_bnext != -1) {
+		coremaps[page->cm_bnext].cm_bprev = page->cm_bprev;
+	}
+	page->cm_order = -1;
+}
+
+/*
+ * Frame idx just became free: add it, merging it with its free buddies
+ */
+static
+void
+cm_buddy_free(size_t idx) {
+	unsigned order = 0;
+	while (order + 1 < CM_BUDDY_ORDERS) {
+		size_t buddy = idx ^ ((size_t)1 << order);
+		if (buddy >= cm_npages || coremaps[buddy].cm_order != (int)order) {
+			break;
+		}
+		cm_buddy_remove(buddy);
+		if (buddy < idx) idx = buddy;
+		order += 1;
+	}
+	cm_buddy_insert(idx, order);
+}
+
+/*
+ * Take the free frame idx out of the block it is in, and give back the
+ * rest of the block as smaller blocks
+ */
+static
+void
+cm_buddy_take(size_t idx) {
+	// The block that has idx starts at idx rounded down to its size
+	unsigned order = 0;
+	size_t head = idx;
+	while (coremaps[head].cm_order != (int)order) {
+		order += 1;
+		KASSERT(order < CM_BUDDY_ORDERS);
+		head = idx & ~(((size_t)1 << order) - 1);
+	}
+	cm_buddy_remove(head);
+
+	// Split it in halves, keeping the half that has idx
+	while (order > 0) {
+		order -= 1;
+		size_t half = (size_t)1 << order;
+		if (idx < head + half) {
+			cm_buddy_insert(head + half, order);
+		}
+		else {
+			cm_buddy_insert(head, order);
+			head += half;
+		}
+	}
+	KASSERT(head == idx);
+}
+
+/*
+ * Find npages free frames in a row, in the smallest free block that is
+ * large enough. Returns the first frame, or -1 if there is no such block.
+ */
+static
+int
+cm_buddy_find(size_t npages) {
+	unsigned order = 0;
+	while (order < CM_BUDDY_ORDERS && ((size_t)1 << order) < npages) {
+		order += 1;
+	}
+	for (; order < CM_BUDDY_ORDERS; ++order) {
+		if (cm_buddy_heads[order] != -1) return cm_buddy_heads[order];
+	}
+	return -1;
 }
 
 /*
@@ -38,8 +387,17 @@ void coremaps_lock_init(){
 			panic("coremaps_lock created failed\n");
 		}
 	}
+	if(cm_busy_cv == NULL){
+		cm_busy_cv = cv_create("coremaps_busy");
+		if(cm_busy_cv == NULL){
+			panic("coremaps_busy created failed\n");
+		}
+	}
 }
 
+static paddr_t cm_allocRegion(size_t start, size_t len,
+		struct addrspace* as, vaddr_t vaddr);
+
 /*
  * To initialize the coremaps
  */
@@ -77,7 +435,44 @@ void coremaps_init(){
 		coremaps[i].cm_as = NULL;
 		coremaps[i].cm_vaddr = 0;
 		coremaps[i].npages = 0;
+		coremaps[i].referenced = false;
+		coremaps[i].refcount = 0;
+		coremaps[i].cm_vn = NULL;
+		coremaps[i].cm_offset = 0;
+		coremaps[i].cm_hnext = -1;
+		coremaps[i].busy = false;
+		coremaps[i].ws_referenced = false;
+		coremaps[i].cm_order = -1;
+	}
+	cm_nfree = cm_npages;
+
+	// Put all of memory in the largest blocks that fit
+	for(size_t i = 0; i < CM_BUDDY_ORDERS; i++){
+		cm_buddy_heads[i] = -1;
+	}
+	for(size_t i = 0; i < cm_npages; ){
+		unsigned order = CM_BUDDY_ORDERS - 1;
+		while ((i & ((1 << order) - 1)) != 0 || i + (1 << order) > cm_npages) {
+			order -= 1;
+		}
+		cm_buddy_insert(i, order);
+		i += 1 << order;
+	}
+
+	for(size_t i = 0; i < MAXCPUS; i++){
+		spinlock_init(&cm_magazines[i].mag_lock);
+		cm_magazines[i].mag_count = 0;
+	}
+
+	for(size_t i = 0; i < CM_TEXT_BUCKETS; i++){
+		cm_text_hash[i] = -1;
 	}
+
+	// Nothing else is running yet, so no lock is needed
+	int zero_idx = cm_buddy_find(1);
+	KASSERT(zero_idx >= 0);
+	cm_zero_paddr = cm_allocRegion(zero_idx, 1, NULL, 0);
+	KASSERT(cm_zero_paddr != 0);
 }
 
 /*
@@ -86,17 +481,86 @@ void coremaps_init(){
 static
 bool
 check_free_swap(struct coremap* pg) {
-	// Swappable if address space is not NULL
-	return (pg->cm_as != NULL) || pg->free;
+	// Swappable if address space is not NULL, unless it is being written
+	// out right now
+	return (pg->cm_as != NULL && !pg->busy) || pg->free;
+}
+
+/*
+ * Round robin: simply take the next frame in the map.
+ */
+static size_t cm_get_rr_victim(void){
+	size_t victim;
+
+	victim = next_victim;
+	next_victim = (next_victim + 1) % cm_npages;
+	return victim;
+}
+
+/*
+ * Clock (second chance): sweep the hand around the map, clearing the
+ * reference bit of every used page it passes. The first swappable page
+ * that has not been referenced since the hand last went by is the victim.
+ *
+ * Since the TLB is refilled in software, we only see a reference when the
+ * page faults into the TLB. So when we clear the bit we also drop the TLB
+ * entry, otherwise a hot page would never get its bit set again.
+ */
+static size_t cm_get_clock_victim(void){
+	// Two sweeps are enough: the first clears every reference bit
+	for (size_t i = 0; i < 2 * cm_npages; ++i) {
+		size_t idx = next_victim;
+		struct coremap* page = coremaps + idx;
+		next_victim = (next_victim + 1) % cm_npages;
+
+		// Kernel pages can never be chosen
+		if (!check_free_swap(page)) continue;
+
+		if (!page->free && page->referenced) {
+			// Give it a second chance
+			page->referenced = false;
+			tlb_invalidate(page->cm_vaddr, page->cm_as);
+			continue;
+		}
+		return idx;
+	}
+	// Nothing swappable at all - let cm_findRegion report the failure
+	return next_victim;
+}
+
+static size_t cm_get_victim(void){
+	switch (policy) {
+		case CM_POLICY_RR:
+			return cm_get_rr_victim();
+		case CM_POLICY_CLOCK:
+			return cm_get_clock_victim();
+	}
+	panic("Unknown page replacement policy\n");
+	return 0;
 }
 
 /*
- * Return true if the page is free.
+ * Clock over the frames of one address space only, with a hand of its
+ * own. Returns -1 if as has nothing that can be evicted right now.
  */
 static
-bool
-check_free(struct coremap* pg) {
-	return pg->free;
+int
+cm_get_local_victim(struct addrspace* as) {
+	for (size_t i = 0; i < 2 * cm_npages; ++i) {
+		size_t idx = cm_local_hand;
+		struct coremap* page = coremaps + idx;
+		cm_local_hand = (cm_local_hand + 1) % cm_npages;
+
+		if (page->free || page->cm_as != as || page->busy) continue;
+
+		if (policy == CM_POLICY_CLOCK && page->referenced) {
+			page->referenced = false;
+			tlb_invalidate(page->cm_vaddr, page->cm_as);
+			continue;
+		}
+		return idx;
+	}
+	return -1;
 }
 
 /*
@@ -161,154 +625,2036 @@ cm_findRegion(size_t startidx, size_t len, size_t* region_idx,
 }
 
 /*
- * Allocate a specified region.
- * Swaps out all required pages in the specified region.
+ * Mark frame idx as free (it must be out of the text cache already)
  */
 static
-paddr_t
-cm_allocRegion(size_t start, size_t len, struct addrspace* as, vaddr_t vaddr) {
-	for (size_t idx = start; idx < start + len; ++idx) {
-		KASSERT(idx < cm_npages);
+void
+cm_clear(size_t idx) {
+	struct coremap* page = coremaps + idx;
+	KASSERT(page->cm_vn == NULL);
+	KASSERT(!page->busy);
 
-		// Shorthand
-		struct coremap* page = coremaps + idx;
-		// Must be free or swappable
-		KASSERT(page->free || page->cm_as);
-
-		if (!page->free) {
-
-			uint16_t swap_offset = 0xffff;
-			paddr_t paddr = coremaps_base + (PAGE_SIZE*idx);
-			seg_type type;
-			// Trust that there is no error
-			get_seg_type(page->cm_vaddr, page->cm_as, &type);
-			// Do not swap out the text segment (it is read only)
-			if(type != TEXT) {
-				swapout_mem(paddr, &swap_offset); // set the offset
-			}
+	bool was_free = page->free;
+	cm_set_owner(page, NULL);
+	page->cm_vaddr = 0;
+	page->free = true;
+	page->npages = 0;
+	page->referenced = false;
+	page->refcount = 0;
 
-			// Invalidate the page in the page table
-			pt_invalid(page->cm_vaddr, page->cm_as, swap_offset);
-		}
+	if (!was_free) {
+		cm_nfree += 1;
+		cm_buddy_free(idx);
+	}
+}
 
-		// Allocate the page at block_index + i for this segment
-		page->cm_as = as;
-		page->cm_vaddr = vaddr;
-		page->free = false;
-		page->npages = 0;
+/*
+ * Take the free frame idx out of the free blocks
+ */
+static
+void
+cm_take(size_t idx) {
+	KASSERT(coremaps[idx].free);
 
-		// Next page should have next page virtual address
-		vaddr += PAGE_SIZE;
+	cm_buddy_take(idx);
+	coremaps[idx].free = false;
+	cm_nfree -= 1;
+}
+
+/*
+ * Can frame idx go to swap along with a victim, as page vaddr of as?
+ * Only private pages that are not in use are taken.
+ */
+static
+bool
+cm_cluster_ok(size_t idx, struct addrspace* as, vaddr_t vaddr) {
+	struct coremap* page = coremaps + idx;
+	if (page->free || page->busy || page->cm_as != as ||
+			page->cm_vaddr != vaddr) {
+		return false;
 	}
+	if (page->refcount != 1) return false;
+	// CLOCK gives referenced pages a second chance, leave those alone
+	return policy == CM_POLICY_RR || !page->referenced;
+}
 
-	// First page set must record the number of pages set
-	coremaps[start].npages = len;
+/*
+ * Return true if the page in frame idx was written through any of the
+ * page tables that map it.
+ */
+static
+bool
+cm_dirty(size_t idx) {
+	struct coremap* page = coremaps + idx;
 
-	// Determine the page and zero it
-	paddr_t paddr = start * PAGE_SIZE + coremaps_base;
-	as_zero_region(paddr, len);
-	return paddr;
+	struct pte* pte = pt_lookup(page->cm_vaddr, page->cm_as);
+	if (pte->paddr & PT_DIRTY) return true;
+	if (page->refcount == 1) return false;
+
+	for (struct addrspace* as = cm_as_list; as != NULL; as = as->as_next) {
+		vaddr_t vaddr;
+		struct pte* other = cm_map_lookup(idx, as, &vaddr);
+		if (other != NULL && (other->paddr & PT_DIRTY)) return true;
+	}
+	return false;
 }
 
 /*
- * To get the pages from coremaps
+ * Write the page at vaddr of the file mapping seg, held in frame paddr,
+ * back to the file. Only the part of the page inside the file is
+ * written, mappings never make files longer. A written page that lies
+ * wholly past the end of the file is dropped, and counted and reported
+ * as lost.
  */
-paddr_t
-coremaps_getppages(size_t npages, struct addrspace* as, vaddr_t vaddr) {
+static
+int
+cm_writeback(struct segment* seg, vaddr_t vaddr, paddr_t paddr) {
+	KASSERT(seg->vn != NULL);
 
-	lock_acquire(coremaps_lock);
+	size_t seg_offset = vaddr - seg->vbase;
+	if (seg_offset >= seg->filesize) {
+		vmstats_inc(VMSTAT_MMAP_LOST);
+		kprintf("mmap: dropped a write to 0x%x, past the end of the file\n",
+			vaddr);
+		return 0;
+	}
 
-	// Find the page(s) that we will take over
-	size_t idx;
-	size_t startidx = 0;
-	// Check for a region of free pages
-	int err = cm_findRegion(startidx, npages, &idx, check_free);
+	size_t len = seg->filesize - seg_offset;
+	if (len > PAGE_SIZE) len = PAGE_SIZE;
 
-	// We didn't find a region of free pages - search for a region we can swap
-	if (err) {
-		startidx = cm_get_victim();
-		err = cm_findRegion(startidx, npages, &idx, check_free_swap);
-		if (err) {
-			lock_release(coremaps_lock);
-			return err;
-		}
-	}
+	struct iovec iov;
+	struct uio u;
+	uio_kinit(&iov, &u, (void*)PADDR_TO_KVADDR(paddr), len,
+		seg->file_offset + seg_offset, UIO_WRITE);
 
-	// Allocate the region
-	paddr_t paddr = cm_allocRegion(idx, npages, as, vaddr);
-	lock_release(coremaps_lock);
-	return paddr;
+	int result = VOP_WRITE(seg->vn, &u);
+	if (result == 0 && u.uio_resid != 0) result = EIO;
+	if (result == 0) vmstats_inc(VMSTAT_MMAP_WRITEBACK);
+	return result;
 }
 
 /*
- * To free a page in coremaps. Also invalidate the PT and TLB if necessary.
+ * Mark the page in frame idx dirty or clean in every page table that
+ * maps it (see cm_map_lookup). Clean pages are mapped read only, so the
+ * next write faults and makes them dirty again.
  */
+static
 void
-coremaps_free(paddr_t paddr) {
-	// TODO: Should this be allowed, or panic'd?
-	if (paddr < coremaps_base) return;
+cm_set_dirty(size_t idx, bool dirty) {
+	for (struct addrspace* as = cm_as_list; as != NULL; as = as->as_next) {
+		vaddr_t vaddr;
+		struct pte* pte = cm_map_lookup(idx, as, &vaddr);
+		if (pte == NULL) continue;
+		if (dirty) {
+			pte->paddr |= PT_DIRTY;
+		}
+		else {
+			pte->paddr &= ~PT_DIRTY;
+			tlb_invalidate(vaddr, as);
+		}
+	}
+}
 
-	KASSERT(paddr == (paddr & PAGE_FRAME));
+/*
+ * Write the dirty page in frame idx, which is in seg, out: back to its
+ * file for shared file mappings, to swap otherwise. It can be evicted
+ * without a write afterwards. coremaps_lock is released during the write
+ * so that faults can go on meanwhile; the frame is busy until it is
+ * done. The page is marked clean first, so a write to it in the meantime
+ * faults and makes it dirty again, and callers have to check for that.
+ */
+static
+int
+cm_clean(size_t idx, struct segment* seg) {
+	struct coremap* page = coremaps + idx;
+	paddr_t paddr = coremaps_base + (PAGE_SIZE*idx);
+	vaddr_t vaddr = page->cm_vaddr;
+	struct addrspace* as = page->cm_as;
+	KASSERT(as != NULL && !page->busy);
 
-	// find the index first
-	size_t index = (paddr - coremaps_base) / PAGE_SIZE;
+	struct pte* pte = pt_lookup(vaddr, as);
+	KASSERT(cm_maps(pte, paddr));
 
-	// Don't try to free pages not in the map (this shouldn't happen?)
-	// TODO: KASSERT this?
-	if (index >= cm_npages) {
-		return;
+	bool to_file = seg_shared_file(seg);
+	uint32_t old_offset = pte->swap_offset;
+	uint32_t swap_offset = PT_NO_SWAP;
+	if (!to_file) {
+		int err = swap_reserve(old_offset, &swap_offset);
+		if (err) return err;
+		pte->swap_offset = swap_offset;
 	}
 
+	cm_set_dirty(idx, false);
+	page->busy = true;
+
+	// Nobody can free, share or copy the frame while it is busy
+	lock_release(coremaps_lock);
+	int err = to_file ? cm_writeback(seg, vaddr, paddr) :
+		swap_write(swap_offset, paddr);
 	lock_acquire(coremaps_lock);
 
-	// How many pages were allocated at the same time as this one
-	size_t npages = coremaps[index].npages;
-	struct addrspace* as = coremaps[index].cm_as;
+	page->busy = false;
+	cv_broadcast(cm_busy_cv, coremaps_lock);
+
+	if (err) {
+		// The copy written out is no good, so it has to be written again
+		cm_set_dirty(idx, true);
+	}
+	if (to_file) return err;
+
+	// The page table refers to the new slot either way
+	swap_replace(old_offset, swap_offset);
+	if (err == 0 && page->refcount > 1) {
+		// The sharers get the new copy as well, their old slots are
+		// out of date (they all had the page dirty)
+		for (struct addrspace* other = cm_as_list; other != NULL;
+				other = other->as_next) {
+			struct pte* other_pte = pt_lookup(vaddr, other);
+			if (other == as || !cm_maps(other_pte, paddr) ||
+					other_pte->swap_offset == swap_offset) {
+				continue;
+			}
+			if (other_pte->swap_offset != PT_NO_SWAP) {
+				swap_free(other_pte->swap_offset);
+			}
+			swap_dup(swap_offset);
+			other_pte->swap_offset = swap_offset;
+		}
+	}
+	return err;
+}
+
+/*
+ * Evict the private, dirty page in frame idx together with the dirty
+ * pages that follow it in its segment, writing them all to one extent
+ * of the swap file. Like cm_clean, the pages are busy and read only
+ * while coremaps_lock is released for the write; any of them written to
+ * in the meantime stays resident. Returns ENOMEM if there is nothing to
+ * cluster or no extent for it, and the caller evicts the page on its
+ * own, or EAGAIN if the page itself was written to.
+ */
+static
+int
+cm_evict_cluster(size_t idx, struct segment* seg) {
+	struct addrspace* as = coremaps[idx].cm_as;
+	vaddr_t vaddr = coremaps[idx].cm_vaddr;
+
+	size_t frames[SWAP_CLUSTER];
+	paddr_t paddrs[SWAP_CLUSTER];
+	uint32_t slots[SWAP_CLUSTER];
+	unsigned npages;
+
+	for (npages = 0; npages < SWAP_CLUSTER; ++npages) {
+		vaddr_t page_vaddr = vaddr + npages * PAGE_SIZE;
+		if (page_vaddr >= seg->vtop) break;
+
+		struct pte* pte = pt_lookup(page_vaddr, as);
+		if (pte == NULL ||
+				(pte->paddr & (PT_VALID | PT_DIRTY)) != (PT_VALID | PT_DIRTY)) {
+			break;
+		}
+		frames[npages] = cm_index(pte->paddr & PAGE_FRAME);
+		if (npages > 0 && !cm_cluster_ok(frames[npages], as, page_vaddr)) {
+			break;
+		}
+		paddrs[npages] = pte->paddr & PAGE_FRAME;
+		slots[npages] = pte->swap_offset;
+	}
+	if (npages < 2) return ENOMEM;
+
+	for (unsigned i = 0; i < npages; ++i) {
+		pt_lookup(vaddr + i * PAGE_SIZE, as)->paddr &= ~PT_DIRTY;
+		tlb_invalidate(vaddr + i * PAGE_SIZE, as);
+		coremaps[frames[i]].busy = true;
+	}
+
+	lock_release(coremaps_lock);
+	int err = swapout_cluster(paddrs, slots, npages);
+	lock_acquire(coremaps_lock);
+
+	for (unsigned i = 0; i < npages; ++i) {
+		coremaps[frames[i]].busy = false;
+	}
+	cv_broadcast(cm_busy_cv, coremaps_lock);
+
+	if (err) {
+		for (unsigned i = 0; i < npages; ++i) {
+			pt_lookup(vaddr + i * PAGE_SIZE, as)->paddr |= PT_DIRTY;
+		}
+		return err;
+	}
+
+	bool evicted = false;
+	for (unsigned i = 0; i < npages; ++i) {
+		struct pte* pte = pt_lookup(vaddr + i * PAGE_SIZE, as);
+		pte->swap_offset = slots[i];
+		if (pte->paddr & PT_DIRTY) {
+			// Written to meantime: it keeps the slot, to overwrite later
+			continue;
+		}
+		pt_invalid(vaddr + i * PAGE_SIZE, as, slots[i]);
+		cm_clear(frames[i]);
+		if (i == 0) evicted = true;
+	}
+	return evicted ? 0 : EAGAIN;
+}
+
+/*
+ * Evict the page in frame idx: write it out if it is dirty, and
+ * invalidate every page table entry that maps it. The frame is free
+ * afterwards. coremaps_lock is released during the write (see cm_clean).
+ * Return ENOMEM (and change nothing) if the page is dirty and the swap
+ * file is full, EIO if the write fails, or EAGAIN if the page was
+ * written to again while it was being written out.
+ */
+static
+int
+cm_evict(size_t idx) {
+	struct coremap* page = coremaps + idx;
+	vaddr_t vaddr = page->cm_vaddr;
+
+	struct pte* pte = pt_lookup(vaddr, page->cm_as);
+	KASSERT(pte != NULL);
+	struct segment* seg = seg_find(page->cm_as, vaddr);
+	KASSERT(seg != NULL);
+	// Only write out pages that were modified since they were
+	// loaded. Clean pages still match their swap copy (or the
+	// ELF file / zero fill if they never had one), and the text
+	// segment is read only, so those are simply dropped.
+	bool write;
+	if (seg_shared_file(seg)) {
+		// Goes back to its file instead. Any of the sharers may have
+		// written to it.
+		write = cm_dirty(idx);
+	}
+	else {
+		write = seg->type != TEXT && (pte->paddr & PT_DIRTY);
+		if (write && page->refcount == 1) {
+			int err = cm_evict_cluster(idx, seg);
+			// Went out with its neighbours, or can't go at all
+			if (err != ENOMEM) return err;
+		}
+	}
+	if (write) {
+		int err = cm_clean(idx, seg);
+		if (err) return err;
+		// Used while it was written out, keep it
+		if (cm_dirty(idx)) return EAGAIN;
+	}
+
+	// Keep whatever copy of the page we already have in swap
+	uint32_t swap_offset = pte->swap_offset;
+
+	if (page->refcount == 1) {
+		// Invalidate the page in the page table
+		pt_invalid(vaddr, page->cm_as, swap_offset);
+		cm_text_remove(idx);
+		cm_clear(idx);
+		return 0;
+	}
+
+	// Invalidate it in all of the sharers (cached pages may be at other
+	// addresses, see cm_map_lookup). They all end up referring to the
+	// same swap slot.
+	for (struct addrspace* as = cm_as_list; as != NULL; as = as->as_next) {
+		vaddr_t other_vaddr;
+		struct pte* other = cm_map_lookup(idx, as, &other_vaddr);
+		if (other == NULL) continue;
+
+		// The owner's reference is the one we hand out
+		if (as != page->cm_as && other->swap_offset != swap_offset) {
+			if (other->swap_offset != PT_NO_SWAP) swap_free(other->swap_offset);
+			if (swap_offset != PT_NO_SWAP) swap_dup(swap_offset);
+		}
+		pt_invalid(other_vaddr, as, swap_offset);
+	}
+	// Nobody can start sharing it anymore
+	cm_text_remove(idx);
+	cm_clear(idx);
+	return 0;
+}
+
+/*
+ * Wake up the pageout thread if free frames have run low, with
+ * coremaps_lock held, so that it makes room in the background
+ */
+static
+void
+cm_pageout_wake(void) {
+	KASSERT(lock_do_i_hold(coremaps_lock));
+	if (cm_pageout_cv != NULL && cm_nfree < cm_low_water) {
+		cv_signal(cm_pageout_cv, coremaps_lock);
+	}
+}
+
+/*
+ * Allocate a specified region.
+ * Swaps out all required pages in the specified region.
+ */
+static
+paddr_t
+cm_allocRegion(size_t start, size_t len, struct addrspace* as, vaddr_t vaddr) {
+	// Make room first, so that nothing is allocated if we can't. Each
+	// frame is taken as soon as it is free, since eviction may release
+	// coremaps_lock and let somebody else at the rest of the region.
+	for (size_t idx = start; idx < start + len; ++idx) {
+		KASSERT(idx < cm_npages);
+
+		// Shorthand
+		struct coremap* page = coremaps + idx;
+
+		// Must be free or swappable (still, if we let go of the lock)
+		if (!check_free_swap(page) || (!page->free && cm_evict(idx))) {
+			// Out of swap space, or the region changed
+			while (idx-- > start) cm_clear(idx);
+			return 0;
+		}
+		cm_take(idx);
+	}
+
+	for (size_t idx = start; idx < start + len; ++idx) {
+		struct coremap* page = coremaps + idx;
+
+		// Allocate the page at block_index + i for this segment
+		cm_set_owner(page, as);
+		page->cm_vaddr = vaddr;
+		page->free = false;
+		page->npages = 0;
+		// It is about to be used, so don't make it the next victim
+		page->referenced = true;
+		page->refcount = 1;
+
+		// Next page should have next page virtual address
+		vaddr += PAGE_SIZE;
+	}
+
+	// First page set must record the number of pages set
+	coremaps[start].npages = len;
+
+	// Running low: have the pageout thread make room in the background
+	cm_pageout_wake();
+
+	// Determine the page and zero it
+	paddr_t paddr = start * PAGE_SIZE + coremaps_base;
+	as_zero_region(paddr, len);
+	return paddr;
+}
+
+/*
+ * Take a frame from this CPU's magazine. Returns -1 if it is empty.
+ */
+static
+int
+cm_mag_pop(void) {
+	// We may move to another CPU, but the magazine is locked anyway
+	struct cm_magazine* mag = &cm_magazines[curcpu->c_number];
+	int idx = -1;
+
+	spinlock_acquire(&mag->mag_lock);
+	if (mag->mag_count > 0) {
+		mag->mag_count -= 1;
+		idx = mag->mag_frames[mag->mag_count];
+	}
+	spinlock_release(&mag->mag_lock);
+	return idx;
+}
+
+/*
+ * Put frame idx in this CPU's magazine. Returns false if it is full.
+ */
+static
+bool
+cm_mag_push(size_t idx) {
+	struct cm_magazine* mag = &cm_magazines[curcpu->c_number];
+	bool pushed = false;
+
+	spinlock_acquire(&mag->mag_lock);
+	if (mag->mag_count < CM_MAG_SIZE) {
+		mag->mag_frames[mag->mag_count] = idx;
+		mag->mag_count += 1;
+		pushed = true;
+	}
+	spinlock_release(&mag->mag_lock);
+	return pushed;
+}
+
+/*
+ * Move up to CM_MAG_BATCH free frames from the map to this CPU's
+ * magazine, with coremaps_lock held.
+ */
+static
+void
+cm_mag_refill(void) {
+	KASSERT(lock_do_i_hold(coremaps_lock));
+
+	for (unsigned i = 0; i < CM_MAG_BATCH; ++i) {
+		int idx = cm_buddy_find(1);
+		if (idx < 0) break;
+
+		// Take it out of the map
+		cm_take(idx);
+		if (!cm_mag_push(idx)) {
+			// Someone else filled it up meanwhile
+			cm_clear(idx);
+			break;
+		}
+	}
+
+	// Frames handed out from the magazine never get to cm_allocRegion
+	cm_pageout_wake();
+}
+
+/*
+ * Give frames from the magazines back to the map, with coremaps_lock
+ * held: up to CM_MAG_BATCH from this CPU's magazine, or all of them
+ * from every CPU if all is true. Returns the number of frames freed.
+ */
+static
+unsigned
+cm_mag_drain(bool all) {
+	KASSERT(lock_do_i_hold(coremaps_lock));
+
+	unsigned nframes = 0;
+	unsigned first = all ? 0 : curcpu->c_number;
+	unsigned last = all ? MAXCPUS - 1 : first;
+	for (unsigned cpu = first; cpu <= last; ++cpu) {
+		struct cm_magazine* mag = &cm_magazines[cpu];
+		size_t frames[CM_MAG_SIZE];
+		unsigned count = 0;
+
+		spinlock_acquire(&mag->mag_lock);
+		while (mag->mag_count > 0 && (all || count < CM_MAG_BATCH)) {
+			mag->mag_count -= 1;
+			frames[count++] = mag->mag_frames[mag->mag_count];
+		}
+		spinlock_release(&mag->mag_lock);
+
+		for (unsigned i = 0; i < count; ++i) {
+			cm_clear(frames[i]);
+		}
+		nframes += count;
+	}
+	return nframes;
+}
+
+/*
+ * Take a zeroed frame from the pool, for a single page allocation.
+ * Returns -1 if it is empty. Wakes up the zeroing thread when the pool
+ * runs low.
+ */
+static
+int
+cm_zpool_pop(void) {
+	int idx = -1;
+	bool wake = false;
+
+	spinlock_acquire(&cm_zpool_lock);
+	if (cm_zpool_count > 0) {
+		cm_zpool_count -= 1;
+		idx = cm_zpool_frames[cm_zpool_count];
+	}
+	if (cm_zpool_asleep && cm_zpool_count <= CM_ZPOOL_LOW) {
+		cm_zpool_asleep = false;
+		wake = true;
+	}
+	spinlock_release(&cm_zpool_lock);
+
+	vmstats_inc(idx >= 0 ? VMSTAT_ZERO_POOL_HIT : VMSTAT_ZERO_POOL_MISS);
+	if (wake) V(cm_zpool_sem);
+	return idx;
+}
+
+/*
+ * Give all of the frames in the zeroed pool back to the map, with
+ * coremaps_lock held. Returns the number of frames freed.
+ */
+static
+unsigned
+cm_zpool_drain(void) {
+	KASSERT(lock_do_i_hold(coremaps_lock));
+
+	size_t frames[CM_ZPOOL_SIZE];
+	unsigned count = 0;
+
+	spinlock_acquire(&cm_zpool_lock);
+	while (cm_zpool_count > 0) {
+		cm_zpool_count -= 1;
+		frames[count++] = cm_zpool_frames[cm_zpool_count];
+	}
+	spinlock_release(&cm_zpool_lock);
+
+	for (unsigned i = 0; i < count; ++i) {
+		cm_clear(frames[i]);
+	}
+	return count;
+}
+
+/*
+ * Hand out frame idx, taken from a magazine (or the zeroed pool), as a single page. Does not
+ * need coremaps_lock: nobody looks at a frame in a magazine, and it only
+ * becomes swappable once cm_as is set, which is done last (after busy).
+ */
+static
+paddr_t
+cm_mag_alloc(size_t idx, struct addrspace* as, vaddr_t vaddr, bool zeroed,
+		bool busy) {
+	struct coremap* page = coremaps + idx;
+	KASSERT(!page->free && page->cm_as == NULL && page->npages == 0);
+
+	paddr_t paddr = coremaps_base + (PAGE_SIZE*idx);
+	if (!zeroed) as_zero_region(paddr, 1);
+
+	page->cm_vaddr = vaddr;
+	page->npages = 1;
+	page->referenced = true;
+	page->refcount = 1;
+	page->busy = busy;
+	cm_set_owner(page, as);
+	return paddr;
+}
+
+/*
+ * Move the page in frame src to the free (taken) frame dst, and point
+ * every page table entry that maps it at dst. Like cm_clean, a private
+ * dirty page is made read only while it is copied, so that a write in
+ * the meantime faults and marks it dirty again; the move is given up if
+ * that happens. Shared frames are only moved if nobody wrote to them.
+ * Returns false if the page stays where it is.
+ */
+static
+bool
+cm_migrate(size_t src, size_t dst) {
+	struct coremap* from = coremaps + src;
+	struct coremap* to = coremaps + dst;
+	paddr_t src_paddr = coremaps_base + (PAGE_SIZE*src);
+	paddr_t dst_paddr = coremaps_base + (PAGE_SIZE*dst);
+	struct addrspace* as = from->cm_as;
+	vaddr_t vaddr = from->cm_vaddr;
+	KASSERT(!from->free && as != NULL && !from->busy);
+	KASSERT(!to->free && to->cm_as == NULL);
+
+	struct pte* pte = pt_lookup(vaddr, as);
+	KASSERT(cm_maps(pte, src_paddr));
+	bool was_dirty = (pte->paddr & PT_DIRTY) != 0;
+	if (from->refcount > 1 && cm_dirty(src)) return false;
+
+	pte->paddr &= ~PT_DIRTY;
+	for (struct addrspace* other = cm_as_list; other != NULL;
+			other = other->as_next) {
+		vaddr_t other_vaddr;
+		if (cm_map_lookup(src, other, &other_vaddr) != NULL) {
+			tlb_invalidate(other_vaddr, other);
+		}
+	}
+
+	memmove((void*)PADDR_TO_KVADDR(dst_paddr),
+		(const void*)PADDR_TO_KVADDR(src_paddr), PAGE_SIZE);
+
+	if (cm_dirty(src)) {
+		// Written while we copied it
+		if (was_dirty) pte->paddr |= PT_DIRTY;
+		return false;
+	}
+
+	for (struct addrspace* other = cm_as_list; other != NULL;
+			other = other->as_next) {
+		vaddr_t other_vaddr;
+		struct pte* other_pte = cm_map_lookup(src, other, &other_vaddr);
+		if (other_pte == NULL) continue;
+
+		other_pte->paddr = dst_paddr | (other_pte->paddr & ~PAGE_FRAME);
+		tlb_invalidate(other_vaddr, other);
+	}
+	if (was_dirty) pte->paddr |= PT_DIRTY;
+
+	if (from->cm_vn != NULL) {
+		struct vnode* vn = from->cm_vn;
+		off_t offset = from->cm_offset;
+		cm_text_remove(src);
+		cm_text_insert(dst, vn, offset);
+	}
+	cm_set_owner(to, as);
+	to->cm_vaddr = vaddr;
+	to->npages = 1;
+	to->refcount = from->refcount;
+	to->referenced = from->referenced;
+	to->ws_referenced = from->ws_referenced;
+	return true;
+}
+
+/*
+ * Make room for npages contiguous frames by moving the pages that are in
+ * the way to free frames elsewhere, rather than evicting them. The run
+ * that needs the fewest moves is chosen; kernel and busy frames can't be
+ * moved. Returns the first frame of the run, which is free afterwards,
+ * or -1 if there is no such run (or a page could not be moved).
+ */
+static
+int
+cm_compact(size_t npages) {
+	KASSERT(lock_do_i_hold(coremaps_lock));
+	if (npages > cm_npages) return -1;
+
+	// Slide a window of npages frames over the map, counting the frames
+	// in it that are used, and those that can't be moved at all
+	size_t best = cm_npages;
+	size_t best_used = cm_npages;
+	size_t used = 0;
+	size_t pinned = 0;
+	for (size_t idx = 0; idx < cm_npages; ++idx) {
+		struct coremap* page = coremaps + idx;
+		if (!page->free) used += 1;
+		if (!check_free_swap(page)) pinned += 1;
+
+		if (idx >= npages) {
+			struct coremap* old = coremaps + idx - npages;
+			if (!old->free) used -= 1;
+			if (!check_free_swap(old)) pinned -= 1;
+		}
+		if (idx + 1 < npages || pinned > 0) continue;
+
+		if (used < best_used) {
+			best = idx + 1 - npages;
+			best_used = used;
+		}
+	}
+	// Nowhere to go for the pages in the way?
+	if (best == cm_npages || cm_nfree < npages) return -1;
+
+	vmstats_inc(VMSTAT_COMPACT_RUN);
+
+	// Keep the free frames of the run out of reach first, so that the
+	// pages in the way don't move into it
+	for (size_t idx = best; idx < best + npages; ++idx) {
+		if (coremaps[idx].free) cm_take(idx);
+	}
+
+	bool moved = true;
+	for (size_t idx = best; idx < best + npages && moved; ++idx) {
+		if (coremaps[idx].cm_as == NULL) continue;
+
+		int dst = cm_buddy_find(1);
+		if (dst < 0) {
+			moved = false;
+			break;
+		}
+		cm_take(dst);
+		moved = cm_migrate(idx, dst);
+		if (!moved) {
+			cm_clear(dst);
+			break;
+		}
+		vmstats_inc(VMSTAT_COMPACT_MIGRATE);
+		// Nothing maps it anymore
+		coremaps[idx].refcount = 0;
+		cm_set_owner(coremaps + idx, NULL);
+	}
+
+	// Give back the run (it stays together, and is ours if we are done)
+	for (size_t idx = best; idx < best + npages; ++idx) {
+		if (coremaps[idx].cm_as == NULL) cm_clear(idx);
+	}
+	if (!moved) {
+		vmstats_inc(VMSTAT_COMPACT_FAIL);
+		return -1;
+	}
+	return best;
+}
+
+/*
+ * Get pages with coremaps_lock already held. Return 0 if there is no
+ * region that we can use.
+ */
+static
+paddr_t
+cm_getppages(size_t npages, struct addrspace* as, vaddr_t vaddr) {
+
+	KASSERT(lock_do_i_hold(coremaps_lock));
+
+	// A process at its resident limit, or one that holds more than its
+	// working set while memory is full, replaces one of its own pages
+	// before it takes anybody else's
+	if (npages == 1 && as != NULL && (cm_over_limit(as) ||
+			(cm_nfree == 0 && as->as_ws > 0 && as->as_rss > as->as_ws))) {
+		int victim = cm_get_local_victim(as);
+		if (victim >= 0) {
+			paddr_t paddr = cm_allocRegion(victim, 1, as, vaddr);
+			if (paddr != 0) {
+				vmstats_inc(VMSTAT_LOCAL_REPLACE);
+				return paddr;
+			}
+		}
+	}
+
+	// Check for a block of free pages
+	int free_idx = cm_buddy_find(npages);
+
+	if (free_idx < 0 && npages > 1 &&
+			cm_mag_drain(true) + cm_zpool_drain() > 0) {
+		// The frames we need may be sitting in the magazines
+		free_idx = cm_buddy_find(npages);
+	}
+
+	if (free_idx < 0 && npages > 1) {
+		// There may be enough free frames, just not next to each other
+		free_idx = cm_compact(npages);
+	}
+
+	if (free_idx >= 0) {
+		// Allocate the region
+		return cm_allocRegion(free_idx, npages, as, vaddr);
+	}
+
+	if (npages == 1) {
+		// A zeroed frame is still free memory: use it before evicting
+		int idx = cm_zpool_pop();
+		if (idx >= 0) {
+			cm_pageout_wake();
+			return cm_mag_alloc(idx, as, vaddr, true, false);
+		}
+	}
+
+	// We didn't find a region of free pages - search for a region we can
+	// swap. If the swap file is full only clean pages can be evicted, so
+	// try a few different victims before giving up.
+	for (size_t tries = 0; tries < CM_EVICT_TRIES; ++tries) {
+		size_t idx;
+		size_t startidx = cm_get_victim();
+		int err = cm_findRegion(startidx, npages, &idx, check_free_swap);
+		if (err) {
+			return 0;
+		}
+
+		paddr_t paddr = cm_allocRegion(idx, npages, as, vaddr);
+		if (paddr != 0) return paddr;
+	}
+	return 0;
+}
+
+/*
+ * Drop the mapping that as has of frame idx. The frame is freed once
+ * nobody maps it anymore. Does not touch the page table entry.
+ */
+static
+void
+cm_release(size_t idx, struct addrspace* as) {
+	struct coremap* page = coremaps + idx;
+	KASSERT(page->refcount > 0);
+
+	page->refcount -= 1;
+	if (page->refcount == 0) {
+		cm_text_remove(idx);
+		cm_clear(idx);
+		return;
+	}
+
+	if (page->cm_as != as) return;
+
+	// We were the owner - hand the frame over to one of the other sharers,
+	// at the address that one maps it at
+	for (struct addrspace* other = cm_as_list; other != NULL;
+			other = other->as_next) {
+		vaddr_t vaddr;
+		if (other == as) continue;
+		if (cm_map_lookup(idx, other, &vaddr) != NULL) {
+			cm_set_owner(page, other);
+			page->cm_vaddr = vaddr;
+			return;
+		}
+	}
+	panic("coremaps: lost track of a shared frame\n");
+}
+
+/*
+ * Get pages for as at vaddr, busy if asked to (see coremaps_fault_alloc)
+ */
+static
+paddr_t
+cm_get(size_t npages, struct addrspace* as, vaddr_t vaddr, bool busy) {
+
+	// Most requests are for one page: take a frame that is zeroed
+	// already if there is one, or else one from this CPU's magazine
+	// (unless the process is at its limit, and has to replace a page of
+	// its own instead)
+	bool capped = cm_over_limit(as);
+	int idx = (npages == 1 && !capped) ? cm_zpool_pop() : -1;
+	if (idx >= 0) {
+		// The pool is only filled above cm_high_water, but memory may
+		// have run low since
+		if (cm_nfree < cm_low_water) {
+			lock_acquire(coremaps_lock);
+			cm_pageout_wake();
+			lock_release(coremaps_lock);
+		}
+		return cm_mag_alloc(idx, as, vaddr, true, busy);
+	}
+	idx = (npages == 1 && !capped) ? cm_mag_pop() : -1;
+	if (idx >= 0) {
+		return cm_mag_alloc(idx, as, vaddr, false, busy);
+	}
+
+	lock_acquire(coremaps_lock);
+	if (npages == 1 && !capped) {
+		cm_mag_refill();
+		idx = cm_mag_pop();
+	}
+	paddr_t paddr = (idx >= 0) ? cm_mag_alloc(idx, as, vaddr, false, busy) :
+		cm_getppages(npages, as, vaddr);
+	if (paddr != 0 && busy) {
+		// Before anyone can pick it as a victim
+		coremaps[cm_index(paddr)].busy = true;
+	}
+	lock_release(coremaps_lock);
+	return paddr;
+}
+
+/*
+ * To get the pages from coremaps
+ */
+paddr_t
+coremaps_getppages(size_t npages, struct addrspace* as, vaddr_t vaddr) {
+	return cm_get(npages, as, vaddr, false);
+}
+
+/*
+ * Get a busy frame for a page fault to load the page at vaddr into
+ */
+paddr_t
+coremaps_fault_alloc(struct addrspace* as, vaddr_t vaddr) {
+	KASSERT(as != NULL);
+	return cm_get(1, as, vaddr, true);
+}
+
+/*
+ * The page fault is done with the frame from coremaps_fault_alloc
+ */
+void
+coremaps_fault_done(struct addrspace* as, vaddr_t vaddr, paddr_t paddr,
+		bool loaded) {
+	size_t idx = cm_index(paddr);
+
+	lock_acquire(coremaps_lock);
+	KASSERT(coremaps[idx].busy);
+	coremaps[idx].busy = false;
+
+	if (!loaded) {
+		// Whatever is in the frame is no good: nobody may share it, and
+		// the next fault on the page starts over
+		struct pte* pte = pt_lookup(vaddr, as);
+		if (cm_maps(pte, paddr)) {
+			pt_invalid(vaddr, as, pte->swap_offset);
+		}
+		cm_release(idx, as);
+	}
+
+	cv_broadcast(cm_busy_cv, coremaps_lock);
+	lock_release(coremaps_lock);
+}
+
+/*
+ * One round of the pageout thread: clean and evict pages until there are
+ * cm_high_water free frames, or nothing more can be freed.
+ */
+static
+void
+cm_pageout_round(void) {
+	for (size_t tries = 0; cm_nfree < cm_high_water && tries < 2 * cm_npages;
+			++tries) {
+		size_t idx = cm_get_victim();
+		struct coremap* page = coremaps + idx;
+		if (page->free || !check_free_swap(page)) continue;
+
+		struct segment* seg = seg_find(page->cm_as, page->cm_vaddr);
+		KASSERT(seg != NULL);
+		struct pte* pte = pt_lookup(page->cm_vaddr, page->cm_as);
+
+		// Pages of shared file mappings are written back by cm_evict
+		if (seg->type != TEXT && !seg_shared_file(seg) &&
+				(pte->paddr & PT_DIRTY)) {
+			// Shared pages are left to the faulting threads, they
+			// can't be cleaned in the background
+			if (page->refcount != 1) continue;
+			if (cm_clean(idx, seg)) return; // out of swap
+
+			vmstats_inc(VMSTAT_PAGEOUT_CLEAN);
+
+			// Used again while it was being written out? Then it stays
+			if (policy == CM_POLICY_CLOCK && page->referenced) continue;
+			pte = pt_lookup(page->cm_vaddr, page->cm_as);
+			if (pte->paddr & PT_DIRTY) continue;
+		}
+
+		// Clean now, so this doesn't write anything
+		int err = cm_evict(idx);
+		if (err == EAGAIN) continue;
+		if (err) return;
+		vmstats_inc(VMSTAT_PAGEOUT_EVICT);
+	}
+}
+
+/*
+ * The pageout thread: whenever free frames run low, evict pages until
+ * there are enough of them again, so that faults rarely have to.
+ */
+static
+void
+cm_pageout_thread(void* unused1, unsigned long unused2) {
+	(void)unused1;
+	(void)unused2;
+
+	lock_acquire(coremaps_lock);
+	while (true) {
+		cv_wait(cm_pageout_cv, coremaps_lock);
+		cm_pageout_round();
+	}
+}
+
+/*
+ * Wait until the zeroed pool runs low again
+ */
+static
+void
+cm_zero_sleep(void) {
+	spinlock_acquire(&cm_zpool_lock);
+	cm_zpool_asleep = true;
+	spinlock_release(&cm_zpool_lock);
+	P(cm_zpool_sem);
+}
+
+/*
+ * The zeroing thread: keeps the zeroed pool full, as long as there are
+ * more than cm_high_water free frames. Frames are zeroed without any
+ * lock held, and the thread yields after each one, so that it only runs
+ * when nobody else has anything to do.
+ */
+static
+void
+cm_zero_thread(void* unused1, unsigned long unused2) {
+	(void)unused1;
+	(void)unused2;
+
+	while (true) {
+		spinlock_acquire(&cm_zpool_lock);
+		bool full = (cm_zpool_count == CM_ZPOOL_SIZE);
+		spinlock_release(&cm_zpool_lock);
+		if (full) {
+			cm_zero_sleep();
+			continue;
+		}
+
+		// Take a frame out of the map, if it can spare one
+		int idx = -1;
+		lock_acquire(coremaps_lock);
+		if (cm_nfree > cm_high_water) {
+			idx = cm_buddy_find(1);
+			if (idx >= 0) cm_take(idx);
+		}
+		lock_release(coremaps_lock);
+		if (idx < 0) {
+			cm_zero_sleep();
+			continue;
+		}
+
+		as_zero_region(coremaps_base + (PAGE_SIZE*idx), 1);
+
+		bool pushed = false;
+		spinlock_acquire(&cm_zpool_lock);
+		if (cm_zpool_count < CM_ZPOOL_SIZE) {
+			cm_zpool_frames[cm_zpool_count] = idx;
+			cm_zpool_count += 1;
+			pushed = true;
+		}
+		spinlock_release(&cm_zpool_lock);
+
+		if (!pushed) {
+			// Drained and refilled meanwhile: give it back
+			lock_acquire(coremaps_lock);
+			cm_clear(idx);
+			lock_release(coremaps_lock);
+		}
+
+		thread_yield();
+	}
+}
+
+/*
+ * The working set sampler: every CM_WS_INTERVAL seconds, count the
+ * frames each address space used since the last pass, and how often it
+ * faulted. The reference bits are cleared (and the TLB entries dropped)
+ * so that the next pass only sees the pages used again.
+ */
+static
+void
+cm_ws_thread(void* unused1, unsigned long unused2) {
+	(void)unused1;
+	(void)unused2;
+
+	while (true) {
+		clocksleep(CM_WS_INTERVAL);
+
+		lock_acquire(coremaps_lock);
+		for (size_t idx = 0; idx < cm_npages; ++idx) {
+			struct coremap* page = coremaps + idx;
+			if (page->free || page->cm_as == NULL ||
+					!page->ws_referenced) {
+				continue;
+			}
+			page->ws_referenced = false;
+			page->cm_as->as_ws_count += 1;
+			tlb_invalidate(page->cm_vaddr, page->cm_as);
+		}
+
+		for (struct addrspace* as = cm_as_list; as != NULL;
+				as = as->as_next) {
+			as->as_ws = as->as_ws_count;
+			as->as_ws_count = 0;
+			as->as_fault_rate = (as->as_faults - as->as_faults_sampled) /
+				CM_WS_INTERVAL;
+			as->as_faults_sampled = as->as_faults;
+		}
+		lock_release(coremaps_lock);
+	}
+}
+
+/*
+ * Start the pageout, zeroing and working set threads
+ */
+void
+coremaps_pageout_start(void) {
+	KASSERT(cm_pageout_cv == NULL);
+
+	cm_low_water = cm_npages / 32 + 1;
+	cm_high_water = 2 * cm_low_water;
+
+	cm_pageout_cv = cv_create("pageout");
+	if (cm_pageout_cv == NULL) {
+		panic("pageout cv created failed\n");
+	}
+
+	int err = thread_fork("pageout", NULL, cm_pageout_thread, NULL, 0);
+	if (err) {
+		panic("pageout thread: thread_fork failed: %s\n", strerror(err));
+	}
+
+	cm_zpool_sem = sem_create("zpool", 0);
+	if (cm_zpool_sem == NULL) {
+		panic("zpool sem created failed\n");
+	}
+
+	err = thread_fork("zeroer", NULL, cm_zero_thread, NULL, 0);
+	if (err) {
+		panic("zeroing thread: thread_fork failed: %s\n", strerror(err));
+	}
+
+	err = thread_fork("wsample", NULL, cm_ws_thread, NULL, 0);
+	if (err) {
+		panic("working set thread: thread_fork failed: %s\n", strerror(err));
+	}
+}
+
+/*
+ * To free a page in coremaps. Also invalidate the PT and TLB if necessary.
+ */
+void
+coremaps_free(paddr_t paddr) {
+	// TODO: Should this be allowed, or panic'd?
+	if (paddr < coremaps_base) return;
+
+	KASSERT(paddr == (paddr & PAGE_FRAME));
+
+	// find the index first
+	size_t index = (paddr - coremaps_base) / PAGE_SIZE;
+
+	// Don't try to free pages not in the map (this shouldn't happen?)
+	// TODO: KASSERT this?
+	if (index >= cm_npages) {
+		return;
+	}
+
+	struct coremap* page = coremaps + index;
+	if (page->npages == 1 && page->cm_as == NULL) {
+		// A single kernel page: nobody else looks at it, so it can go
+		// into this CPU's magazine without coremaps_lock
+		page->npages = 0;
+		page->referenced = false;
+		page->refcount = 0;
+		if (cm_mag_push(index)) return;
+
+		// Full - make room for it
+		lock_acquire(coremaps_lock);
+		cm_mag_drain(false);
+		if (!cm_mag_push(index)) {
+			cm_clear(index);
+		}
+		lock_release(coremaps_lock);
+		return;
+	}
+
+	lock_acquire(coremaps_lock);
+
+	// How many pages were allocated at the same time as this one
+	size_t npages = coremaps[index].npages;
+	struct addrspace* as = coremaps[index].cm_as;
 
 	KASSERT(npages > 0);
 
-	// Free all pages that were allocated
-	for (; npages > 0; --npages) {
-		KASSERT(index < cm_npages);
+	// Free all pages that were allocated
+	for (; npages > 0; --npages) {
+		KASSERT(index < cm_npages);
+
+		if (as != NULL) {
+			// Invalidate the page in the page table (not for kernel though)
+			// and give back any swap copy it was still holding on to
+			vaddr_t vaddr = coremaps[index].cm_vaddr;
+			struct pte* pte = pt_lookup(vaddr, as);
+			if (pte != NULL && pte->swap_offset != PT_NO_SWAP) {
+				swap_free(pte->swap_offset);
+			}
+			pt_invalid(vaddr, as, PT_NO_SWAP);
+		}
+		// Invalidate the coremap entry
+		cm_text_remove(index);
+		cm_clear(index);
+		index += 1;
+	}
+
+	lock_release(coremaps_lock);
+}
+
+/*
+ * Give up the frame and the swap slot of the page table entry pte of as,
+ * leaving it empty. Does not touch the TLB.
+ */
+static
+void
+cm_pte_release(struct pte* pte, struct addrspace* as) {
+	// The pageout thread may be writing the page out
+	while ((pte->paddr & PT_VALID) &&
+			coremaps[cm_index(pte->paddr & PAGE_FRAME)].busy) {
+		cv_wait(cm_busy_cv, coremaps_lock);
+	}
+
+	paddr_t paddr = pte->paddr;
+	uint32_t offset = pte->swap_offset;
+	if (paddr & PT_VALID) {
+		// Frame may still be in use by a parent or child
+		cm_release(cm_index(paddr & PAGE_FRAME), as);
+	}
+	if(offset != PT_NO_SWAP) {
+		swap_free(offset);
+	}
+	pte->paddr = paddr & ~(PT_VALID | PT_DIRTY | PT_PREFETCH);
+	pte->swap_offset = PT_NO_SWAP;
+}
+
+/*
+ * To free pages in one address space
+ */
+void
+coremaps_as_free(struct addrspace* as) {
+	lock_acquire(coremaps_lock);
+
+	// Free memory for all pages from this address space
+	for (size_t l1 = 0; l1 < PT_L1_ENTRIES; ++l1) {
+		struct pte* pt = as->as_pt[l1];
+		if (pt == NULL) continue;
+
+		// Iterate over the second level table
+		for (size_t i = 0; i < PT_L2_ENTRIES; ++i) {
+			cm_pte_release(pt + i, as);
+		}
+	}
+
+	// Nothing refers to this address space anymore
+	struct addrspace** link = &cm_as_list;
+	while (*link != NULL && *link != as) link = &(*link)->as_next;
+	if (*link == as) *link = as->as_next;
+	as->as_next = NULL;
+
+	lock_release(coremaps_lock);
+}
+
+/*
+ * Free the frames and swap slots of the pages from start up to end in
+ * as, which is still running. Returns the number of pages that had any.
+ */
+unsigned
+coremaps_as_release(struct addrspace* as, vaddr_t start, vaddr_t end) {
+	unsigned count = 0;
+
+	lock_acquire(coremaps_lock);
+
+	for (vaddr_t vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
+		struct pte* pte = pt_lookup(vaddr, as);
+		if (pte == NULL) continue;
+		if ((pte->paddr & PT_VALID) == 0 && pte->swap_offset == PT_NO_SWAP) {
+			continue;
+		}
+
+		cm_pte_release(pte, as);
+		tlb_invalidate(vaddr, as);
+		count += 1;
+	}
+
+	lock_release(coremaps_lock);
+	return count;
+}
+
+/*
+ * Write the pages of the shared file mapping seg that as has written to
+ * back to the file, without coremaps_lock held during the writes. They
+ * stay mapped, but read only, so that the next write marks them dirty
+ * again. Returns the first error, after trying all of them.
+ */
+int
+coremaps_sync(struct addrspace* as, struct segment* seg) {
+	KASSERT(seg_shared_file(seg));
+	int result = 0;
+
+	lock_acquire(coremaps_lock);
+
+	for (vaddr_t vaddr = seg->vbase; vaddr < seg->vtop; vaddr += PAGE_SIZE) {
+		struct pte* pte = pt_lookup(vaddr, as);
+		if (pte == NULL) continue;
+
+		// The pageout thread may be evicting the page
+		while ((pte->paddr & PT_VALID) &&
+				coremaps[cm_index(pte->paddr & PAGE_FRAME)].busy) {
+			cv_wait(cm_busy_cv, coremaps_lock);
+		}
+		if ((pte->paddr & (PT_VALID | PT_DIRTY)) != (PT_VALID | PT_DIRTY)) {
+			continue;
+		}
+
+		// Marks it clean for every sharer, and dirty again if it fails.
+		// It is written back through the owner's mapping, which may be
+		// at another address.
+		size_t idx = cm_index(pte->paddr & PAGE_FRAME);
+		struct coremap* page = coremaps + idx;
+		int err = cm_clean(idx, seg_find(page->cm_as, page->cm_vaddr));
+		if (err && result == 0) result = err;
+	}
+
+	lock_release(coremaps_lock);
+	return result;
+}
+
+/*
+ * Find the frame caching page `offset` of vn, once nobody is loading or
+ * writing it out anymore, or return -1
+ */
+static
+int
+cm_text_find_idle(struct vnode* vn, off_t offset) {
+	int idx;
+	while ((idx = cm_text_find(vn, offset)) != -1 && coremaps[idx].busy) {
+		cv_wait(cm_busy_cv, coremaps_lock);
+	}
+	return idx;
+}
+
+/*
+ * Write back the cached pages of vn between offset and offset + len that
+ * were written through a shared mapping, so that read(2) and write(2)
+ * see them.
+ */
+int
+coremaps_file_sync(struct vnode* vn, off_t offset, size_t len) {
+	int result = 0;
+
+	lock_acquire(coremaps_lock);
+
+	for (off_t page = offset - offset % PAGE_SIZE;
+			result == 0 && page < offset + (off_t)len; page += PAGE_SIZE) {
+		int idx = cm_text_find_idle(vn, page);
+		if (idx == -1 || !cm_dirty(idx)) continue;
+
+		struct coremap* frame = coremaps + idx;
+		result = cm_clean(idx, seg_find(frame->cm_as, frame->cm_vaddr));
+	}
+
+	lock_release(coremaps_lock);
+	return result;
+}
+
+/*
+ * Drop the cached pages of vn between offset and offset + len after a
+ * write(2) to them, so that the mappings load the new contents on their
+ * next access. A page written through a mapping meanwhile is kept, that
+ * write came last.
+ */
+void
+coremaps_file_written(struct vnode* vn, off_t offset, size_t len) {
+	lock_acquire(coremaps_lock);
+
+	for (off_t page = offset - offset % PAGE_SIZE;
+			page < offset + (off_t)len; page += PAGE_SIZE) {
+		int idx = cm_text_find_idle(vn, page);
+		if (idx == -1 || cm_dirty(idx)) continue;
+
+		// Clean, so nothing is written and the lock is kept
+		int err = cm_evict(idx);
+		KASSERT(err == 0);
+	}
+
+	lock_release(coremaps_lock);
+}
+
+/*
+ * Make an address space known to the coremap
+ */
+void
+coremaps_as_register(struct addrspace* as) {
+	lock_acquire(coremaps_lock);
+	as->as_next = cm_as_list;
+	cm_as_list = as;
+	lock_release(coremaps_lock);
+}
+
+/*
+ * Add seg to the segments of as (see seg_add). Other threads walk the
+ * segments of every address space with coremaps_lock held (to find the
+ * sharers of a cached frame, for one), so the list only changes with it
+ * held.
+ */
+int
+coremaps_seg_add(struct addrspace* as, struct segment* seg) {
+	lock_acquire(coremaps_lock);
+	int result = seg_add(as, seg);
+	lock_release(coremaps_lock);
+	return result;
+}
+
+/*
+ * Take seg out of the segments of as. Nobody else can get at it
+ * afterwards, so the caller can free it.
+ */
+void
+coremaps_seg_remove(struct addrspace* as, struct segment* seg) {
+	lock_acquire(coremaps_lock);
+	seg_remove(as, seg);
+	lock_release(coremaps_lock);
+}
 
-		if (as != NULL) {
-			// Invalidate the page in the page table (not for kernel though)
-			vaddr_t vaddr = coremaps[index].cm_vaddr;
-			pt_invalid(vaddr, as, 0xffff);
+/*
+ * Make seg cover vbase up to vtop (for the heap and the stack)
+ */
+void
+coremaps_seg_resize(struct segment* seg, vaddr_t vbase, vaddr_t vtop) {
+	lock_acquire(coremaps_lock);
+	seg->vbase = vbase;
+	seg->vtop = vtop;
+	seg->npages = (vtop - vbase) / PAGE_SIZE;
+	lock_release(coremaps_lock);
+}
+
+/*
+ * Share all resident and swapped pages of old with new (copy-on-write).
+ * Nothing is copied until one of them writes to a page, see coremaps_cow.
+ */
+void
+coremaps_as_copy(struct addrspace* old, struct addrspace* new) {
+	lock_acquire(coremaps_lock);
+
+	for (size_t l1 = 0; l1 < PT_L1_ENTRIES; ++l1) {
+		struct pte* oldpt = old->as_pt[l1];
+		struct pte* newpt = new->as_pt[l1];
+		if (oldpt == NULL) continue;
+		// as_copy allocated it
+		KASSERT(newpt != NULL);
+
+		for (size_t i = 0; i < PT_L2_ENTRIES; ++i) {
+			// A page being written out gets its slot afterwards
+			while ((oldpt[i].paddr & PT_VALID) &&
+					coremaps[cm_index(oldpt[i].paddr & PAGE_FRAME)].busy) {
+				cv_wait(cm_busy_cv, coremaps_lock);
+			}
+			newpt[i] = oldpt[i];
+			// The child did not ask for pages read ahead for the parent,
+			// so using them is no readahead hit
+			newpt[i].paddr &= ~PT_PREFETCH;
+			if (oldpt[i].paddr & PT_VALID) {
+				coremaps[cm_index(oldpt[i].paddr & PAGE_FRAME)].refcount += 1;
+			}
+			if (oldpt[i].swap_offset != PT_NO_SWAP) {
+				swap_dup(oldpt[i].swap_offset);
+			}
 		}
-		// Invalidate the coremap entry
-		coremaps[index].cm_as = NULL;
-		coremaps[index].cm_vaddr = 0;
-		coremaps[index].free = true;
-		coremaps[index].npages = 0;
-		index += 1;
 	}
 
 	lock_release(coremaps_lock);
+
+	// The TLB may still let old write to frames that are shared now
+	tlb_flush_as(old);
 }
 
 /*
- * To free pages in one address space
+ * Return true if the frame at paddr is mapped by more than one page table.
+ * Not locked: only a fork of the faulting process can make one of its
+ * frames shared, and if a sharer leaves we just take an extra fault.
+ */
+bool
+coremaps_is_shared(paddr_t paddr) {
+	return coremaps[cm_index(paddr)].refcount > 1;
+}
+
+/*
+ * Give as a private copy of the shared frame mapped at vaddr, and mark it
+ * dirty. The faulting access is retried afterwards, and picks up the new
+ * mapping from the page table.
+ */
+int
+coremaps_cow(struct addrspace* as, vaddr_t vaddr) {
+	vaddr &= PAGE_FRAME;
+
+	lock_acquire(coremaps_lock);
+
+	struct pte* pte = pt_lookup(vaddr, as);
+	KASSERT(pte != NULL);
+
+	// Get the new frame first, since this might evict the shared one
+	paddr_t newpaddr = cm_getppages(1, as, vaddr);
+	if (newpaddr == 0) {
+		lock_release(coremaps_lock);
+		return ENOMEM;
+	}
+
+	// Don't let go of a frame that is being written out. Ours is busy
+	// meanwhile, so that nobody evicts it before it is mapped.
+	size_t newidx = cm_index(newpaddr);
+	coremaps[newidx].busy = true;
+	while ((pte->paddr & PT_VALID) &&
+			coremaps[cm_index(pte->paddr & PAGE_FRAME)].busy) {
+		cv_wait(cm_busy_cv, coremaps_lock);
+	}
+	coremaps[newidx].busy = false;
+
+	if ((pte->paddr & PT_VALID) == 0) {
+		// The shared frame was evicted - just fault it in again
+		cm_release(cm_index(newpaddr), as);
+		lock_release(coremaps_lock);
+		return 0;
+	}
+
+	paddr_t oldpaddr = pte->paddr & PAGE_FRAME;
+	size_t oldidx = cm_index(oldpaddr);
+
+	if (coremaps[oldidx].refcount == 1) {
+		// Everybody else let go of it in the meantime
+		cm_release(cm_index(newpaddr), as);
+		pte->paddr |= PT_DIRTY;
+		lock_release(coremaps_lock);
+		return 0;
+	}
+
+	if (oldpaddr == cm_zero_paddr) {
+		// First write to a page that was only read: the new frame is
+		// zeroed already
+		vmstats_inc(VMSTAT_ZERO_PAGE_COPY);
+	}
+	else {
+		memmove((void*)PADDR_TO_KVADDR(newpaddr),
+				(void*)PADDR_TO_KVADDR(oldpaddr), PAGE_SIZE);
+		vmstats_inc(VMSTAT_COW_FAULT);
+	}
+
+	// Our copy is about to differ from the shared swap copy (if any)
+	if (pte->swap_offset != PT_NO_SWAP) {
+		swap_free(pte->swap_offset);
+		pte->swap_offset = PT_NO_SWAP;
+	}
+	pte->paddr = newpaddr | (pte->paddr & ~PAGE_FRAME) | PT_DIRTY;
+	cm_release(oldidx, as);
+
+	tlb_invalidate(vaddr, as);
+
+	lock_release(coremaps_lock);
+	return 0;
+}
+
+/*
+ * Map the zero frame read only at vaddr of as, for a read of a page that
+ * would be zero filled. The first write to it gets a private frame like
+ * any other shared frame (see coremaps_cow), so memory that is only
+ * read costs no frames. Return the frame.
+ */
+paddr_t
+coremaps_zero_share(struct addrspace* as, vaddr_t vaddr) {
+	vaddr &= PAGE_FRAME;
+
+	lock_acquire(coremaps_lock);
+
+	struct pte* pte = pt_lookup(vaddr, as);
+	KASSERT(pte != NULL);
+
+	if ((pte->paddr & PT_VALID) == 0) {
+		coremaps[cm_index(cm_zero_paddr)].refcount += 1;
+		pte->paddr = cm_zero_paddr |
+			(pte->paddr & ~(PAGE_FRAME | PT_DIRTY | PT_PREFETCH)) | PT_VALID;
+	}
+	paddr_t paddr = pte->paddr & PAGE_FRAME;
+
+	lock_release(coremaps_lock);
+	return paddr;
+}
+
+/*
+ * Return true if as can map the cached frame idx at vaddr. Program text
+ * and shared file mappings keep separate copies of a file, since only
+ * the latter are ever written back. An address space maps a frame at
+ * most once, so a second mapping of the same part of the file gets a
+ * copy of its own.
+ */
+static
+bool
+cm_text_usable(size_t idx, struct addrspace* as, vaddr_t vaddr) {
+	struct coremap* page = coremaps + idx;
+	struct segment* ours = seg_find(as, vaddr);
+	struct segment* theirs = seg_find(page->cm_as, page->cm_vaddr);
+	KASSERT(ours != NULL && theirs != NULL);
+	if (ours->type != theirs->type) return false;
+
+	vaddr_t mapped;
+	return cm_map_lookup(idx, as, &mapped) == NULL || mapped == vaddr;
+}
+
+/*
+ * Map the page at file offset `offset` of vn (program text, or a shared
+ * file mapping) into as at vaddr, if some other process already has it
+ * loaded. The frame is shared whatever address the others map it at
+ * (cm_map_lookup finds all of them), so every shared mapping of the file
+ * sees the same page. Return true if the page table entry is now valid.
+ */
+bool
+coremaps_text_share(struct addrspace* as, vaddr_t vaddr, struct vnode* vn,
+		off_t offset) {
+	vaddr &= PAGE_FRAME;
+
+	lock_acquire(coremaps_lock);
+
+	struct pte* pte = pt_lookup(vaddr, as);
+	KASSERT(pte != NULL);
+
+	// Another process may be loading it right now: wait for that rather
+	// than reading it a second time. If its load fails the page is gone
+	// from the cache again, and we load it ourselves.
+	int idx = cm_text_find_idle(vn, offset);
+	if (idx == -1 || !cm_text_usable(idx, as, vaddr)) {
+		lock_release(coremaps_lock);
+		return false;
+	}
+
+	if ((pte->paddr & PT_VALID) == 0) {
+		coremaps[idx].refcount += 1;
+		coremaps[idx].referenced = true;
+		pte->paddr = (coremaps_base + PAGE_SIZE*idx) |
+			(pte->paddr & ~PAGE_FRAME) | PT_VALID;
+	}
+
+	lock_release(coremaps_lock);
+	return true;
+}
+
+/*
+ * Let other processes share the page that is about to be loaded into the
+ * busy frame at paddr, from file offset `offset` of vn. Anyone else who
+ * faults on it meanwhile waits for the load (see coremaps_text_share),
+ * so the page is only read once.
+ */
+bool
+coremaps_text_publish(struct addrspace* as, vaddr_t vaddr, paddr_t paddr,
+		struct vnode* vn, off_t offset) {
+	vaddr &= PAGE_FRAME;
+
+	lock_acquire(coremaps_lock);
+
+	size_t idx = cm_index(paddr);
+	struct coremap* page = coremaps + idx;
+	KASSERT(page->busy && page->cm_vn == NULL);
+	KASSERT(cm_maps(pt_lookup(vaddr, as), paddr));
+
+	// Somebody may have beaten us to it since we looked. We use their
+	// frame if we can, else we keep our own copy.
+	int other = cm_text_find(vn, offset);
+	if (other == -1) {
+		cm_text_insert(idx, vn, offset);
+	}
+	bool use_ours = (other == -1 || !cm_text_usable(other, as, vaddr));
+
+	lock_release(coremaps_lock);
+	return use_ours;
+}
+
+/*
+ * Read the page at vaddr of as from swap slot swap_offset into the busy
+ * frame paddr. The pages after it in the same segment that are in the
+ * next slots are read along with it, for as long as there are free
+ * frames for them. They are mapped but not referenced, so they are the
+ * first to go if they are never used. coremaps_lock is not held during
+ * the read; the frames are busy until it is done.
+ */
+int
+coremaps_swapin(struct addrspace* as, vaddr_t vaddr, paddr_t paddr,
+		uint32_t swap_offset) {
+	seg_type type;
+	int result = get_seg_type(vaddr, as, &type);
+	if (result) return result;
+
+	paddr_t paddrs[SWAP_CLUSTER];
+	struct pte* ptes[SWAP_CLUSTER];
+	unsigned npages;
+
+	lock_acquire(coremaps_lock);
+
+	paddrs[0] = paddr;
+	for (npages = 1; npages < SWAP_CLUSTER; ++npages) {
+		vaddr_t page_vaddr = vaddr + npages * PAGE_SIZE;
+		seg_type page_type;
+		if (get_seg_type(page_vaddr, as, &page_type) || page_type != type) {
+			break;
+		}
+
+		struct pte* pte = pt_lookup(page_vaddr, as);
+		if (pte == NULL || (pte->paddr & PT_VALID) ||
+				pte->swap_offset != swap_offset + npages) {
+			break;
+		}
+
+		// Readahead never evicts anything, nor takes the process past
+		// its resident limit
+		if (cm_over_limit(as)) break;
+		int idx = cm_buddy_find(1);
+		if (idx < 0) break;
+		paddrs[npages] = cm_allocRegion(idx, 1, as, page_vaddr);
+		coremaps[idx].referenced = false;
+		coremaps[idx].busy = true;
+		ptes[npages] = pte;
+	}
+	KASSERT(coremaps[cm_index(paddr)].busy);
+
+	lock_release(coremaps_lock);
+	result = swapin_cluster(swap_offset, paddrs, npages);
+	lock_acquire(coremaps_lock);
+
+	for (unsigned i = 1; i < npages; ++i) {
+		coremaps[cm_index(paddrs[i])].busy = false;
+		if (result) {
+			cm_release(cm_index(paddrs[i]), as);
+		}
+		else {
+			// Still clean, keep the swap slot
+			ptes[i]->paddr = (ptes[i]->paddr & ~PAGE_FRAME) | paddrs[i] |
+				PT_VALID | PT_PREFETCH;
+		}
+	}
+	if (npages > 1) cv_broadcast(cm_busy_cv, coremaps_lock);
+
+	lock_release(coremaps_lock);
+	return result;
+}
+
+/*
+ * Load the page at vaddr of as from the executable into the busy frame
+ * paddr. The pages after it in the segment that are not loaded yet are
+ * read along with it, up to the fault-around window, with a single read
+ * (and only into free frames, like swap readahead). Like swapin, the
+ * read is done without coremaps_lock; the extra frames are in the text
+ * cache already, but busy, so other processes wait for them.
+ */
+int
+coremaps_faultaround(struct addrspace* as, struct segment* seg,
+		vaddr_t vaddr, paddr_t paddr) {
+	size_t seg_offset = vaddr - seg->vbase;
+	KASSERT(seg_offset < seg->filesize);
+
+	paddr_t paddrs[CM_FAULTAROUND_MAX];
+	struct pte* ptes[CM_FAULTAROUND_MAX];
+	unsigned npages;
+
+	lock_acquire(coremaps_lock);
+
+	paddrs[0] = paddr;
+	for (npages = 1; npages < cm_faultaround; ++npages) {
+		vaddr_t page_vaddr = vaddr + npages * PAGE_SIZE;
+		size_t page_offset = seg_offset + npages * PAGE_SIZE;
+		// Nothing to read past the file data (this also keeps us in
+		// the segment)
+		if (page_offset >= seg->filesize) break;
+
+		struct pte* pte = pt_lookup(page_vaddr, as);
+		if (pte == NULL || (pte->paddr & PT_VALID) ||
+				pte->swap_offset != PT_NO_SWAP) {
+			break;
+		}
+		// Someone else running the program already has it
+		if (seg_cached(seg) && cm_text_find(seg->vn,
+					seg->file_offset + page_offset) != -1) {
+			break;
+		}
+
+		if (cm_over_limit(as)) break;
+		int idx = cm_buddy_find(1);
+		if (idx < 0) break;
+		paddrs[npages] = cm_allocRegion(idx, 1, as, page_vaddr);
+		coremaps[idx].referenced = false;
+		coremaps[idx].busy = true;
+		if (seg_cached(seg)) {
+			cm_text_insert(idx, seg->vn, seg->file_offset + page_offset);
+		}
+		ptes[npages] = pte;
+	}
+	KASSERT(coremaps[cm_index(paddr)].busy);
+	lock_release(coremaps_lock);
+
+	/*
+	 * We are pretending that we are writing to kernel space even though
+	 * we're writing to the physical address of a user space virtual address.
+	 * This is a bit of a hack, but it is necessary so that we can't TLB fault
+	 * in this function, since this is called from within the fault
+	 * handler itself.
+	 */
+	struct iovec iov[CM_FAULTAROUND_MAX];
+	struct uio u;
+
+	for (unsigned i = 0; i < npages; ++i) {
+		iov[i].iov_kbase = (void*)PADDR_TO_KVADDR(paddrs[i]);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	// The last page may only be partly in the file
+	size_t readsize = seg->filesize - seg_offset;
+	if (readsize > npages * PAGE_SIZE) readsize = npages * PAGE_SIZE;
+
+	u.uio_iov = iov;
+	u.uio_iovcnt = npages;
+	u.uio_offset = seg->file_offset + seg_offset;
+	u.uio_resid = readsize;
+	u.uio_segflg = UIO_SYSSPACE;
+	u.uio_rw = UIO_READ;
+	u.uio_space = NULL;
+
+	int result = VOP_READ(seg->vn, &u);
+	if (result == 0 && u.uio_resid != 0) {
+		/* short read; problem with executable? */
+		kprintf("ELF: short read on segment - file truncated?\n");
+		result = ENOEXEC;
+	}
+
+	lock_acquire(coremaps_lock);
+	for (unsigned i = 1; i < npages; ++i) {
+		size_t idx = cm_index(paddrs[i]);
+		coremaps[idx].busy = false;
+		if (result) {
+			// Out of the text cache too, nobody has mapped it yet
+			cm_release(idx, as);
+			continue;
+		}
+
+		ptes[i]->paddr = (ptes[i]->paddr & ~PAGE_FRAME) | paddrs[i] |
+			PT_VALID | PT_PREFETCH;
+		vmstats_inc(VMSTAT_FAULTAROUND);
+	}
+	if (npages > 1) cv_broadcast(cm_busy_cv, coremaps_lock);
+
+	lock_release(coremaps_lock);
+	return result;
+}
+
+/*
+ * Number of frames managed by the coremaps
+ */
+unsigned
+coremaps_nframes(void) {
+	return cm_npages;
+}
+
+/*
+ * Mark the frame at paddr as recently used (called on TLB refill).
+ * No lock needed: losing a race here only costs the page one chance.
  */
 void
-coremaps_as_free(struct addrspace* as) {
-	// Free memory for all segments from this address space
-	for (seg_type type = TEXT; type <= STACK; ++type) {
-		struct pte* pt = get_pt(type, as);
-		if (pt == NULL) continue;
-		struct segment* seg = get_segment(type, as);
-		if (seg == NULL) continue;
-
-		// Iterate over the page table
-		for (size_t i = 0; i < seg->npages; ++i) {
-			paddr_t paddr = pt[i].paddr;
-			uint16_t offset = pt[i].swap_offset;
-			if (paddr & PT_VALID) {
-				coremaps_free(paddr & PAGE_FRAME);
-			}
-			else if(offset != 0xffff) {
-				swap_free(offset);
+coremaps_reference(paddr_t paddr) {
+	if (paddr < coremaps_base) return;
+
+	size_t index = (paddr - coremaps_base) / PAGE_SIZE;
+	if (index >= cm_npages) return;
+
+	coremaps[index].referenced = true;
+	coremaps[index].ws_referenced = true;
+}
+
+/*
+ * Set the number of pages read from the executable per fault.
+ */
+int
+coremaps_set_faultaround(unsigned npages) {
+	if (npages < 1 || npages > CM_FAULTAROUND_MAX) return EINVAL;
+
+	lock_acquire(coremaps_lock);
+	cm_faultaround = npages;
+	lock_release(coremaps_lock);
+	return 0;
+}
+
+/*
+ * Print the free buddy blocks of each size, and how fragmented free
+ * memory is: the share of it that is not in the largest block.
+ */
+void
+coremaps_print_frag(void) {
+	unsigned cached = 0;
+	for (unsigned cpu = 0; cpu < MAXCPUS; ++cpu) {
+		spinlock_acquire(&cm_magazines[cpu].mag_lock);
+		cached += cm_magazines[cpu].mag_count;
+		spinlock_release(&cm_magazines[cpu].mag_lock);
+	}
+
+	lock_acquire(coremaps_lock);
+
+	kprintf("Free frames: %u of %u (%u more in per-CPU caches)\n",
+		(unsigned)cm_nfree, cm_npages, cached);
+
+	size_t largest = 0;
+	for (unsigned order = 0; order < CM_BUDDY_ORDERS; ++order) {
+		unsigned nblocks = 0;
+		for (int idx = cm_buddy_heads[order]; idx != -1;
+				idx = coremaps[idx].cm_bnext) {
+			nblocks += 1;
+		}
+		if (nblocks == 0) continue;
+
+		kprintf("  %5u-frame blocks: %u\n", 1 << order, nblocks);
+		largest = (size_t)1 << order;
+	}
+
+	kprintf("Largest free run: %u frames\n", (unsigned)largest);
+	if (cm_nfree > 0) {
+		kprintf("Fragmentation: %u%%\n",
+			(unsigned)(100 - 100 * largest / cm_nfree));
+	}
+
+	lock_release(coremaps_lock);
+}
+
+/*
+ * Count the pages of as that are out in swap, with coremaps_lock held
+ */
+static
+unsigned
+cm_count_swapped(struct addrspace* as) {
+	unsigned swapped = 0;
+	for (size_t i = 0; i < PT_L1_ENTRIES; ++i) {
+		struct pte* table = as->as_pt[i];
+		if (table == NULL) continue;
+		for (size_t j = 0; j < PT_L2_ENTRIES; ++j) {
+			if (!(table[j].paddr & PT_VALID) &&
+					table[j].swap_offset != PT_NO_SWAP) {
+				swapped += 1;
 			}
 		}
 	}
+	return swapped;
+}
+
+/*
+ * Milliseconds since as was created
+ */
+static
+uint32_t
+cm_lifetime(struct addrspace* as) {
+	time_t sec;
+	uint32_t nsec;
+	gettime(&sec, &nsec);
+	if (nsec < as->as_start_nsec) {
+		nsec += 1000000000;
+		sec -= 1;
+	}
+	return (sec - as->as_start_sec) * 1000 +
+		(nsec - as->as_start_nsec) / 1000000;
+}
+
+/*
+ * Resident plus swapped pages of as (what the OOM killer goes by)
+ */
+unsigned
+coremaps_as_usage(struct addrspace* as) {
+	lock_acquire(coremaps_lock);
+	unsigned pages = as->as_rss + cm_count_swapped(as);
+	lock_release(coremaps_lock);
+	return pages;
+}
+
+/*
+ * Print one line of memory statistics for the process pid
+ */
+void
+coremaps_print_as(pid_t pid, const char* name, struct addrspace* as) {
+	lock_acquire(coremaps_lock);
+	kprintf("%5d %-16s %6u %6u %6u %6u %6u %7u\n", (int)pid, name,
+		as->as_rss, as->as_rss_peak, as->as_ws, cm_count_swapped(as),
+		as->as_faults, as->as_fault_rate);
+	lock_release(coremaps_lock);
+}
+
+/*
+ * Remember the statistics of a process that is exiting
+ */
+void
+coremaps_as_exit(pid_t pid, const char* name, struct addrspace* as) {
+	lock_acquire(coremaps_lock);
+	struct cm_exited* rec = &cm_exited[cm_nexited % CM_EXITED_MAX];
+	cm_nexited += 1;
+
+	rec->pid = pid;
+	snprintf(rec->name, sizeof(rec->name), "%s", name);
+	rec->rss = as->as_rss;
+	rec->rss_peak = as->as_rss_peak;
+	rec->swapped = cm_count_swapped(as);
+	rec->faults = as->as_faults;
+	rec->msecs = cm_lifetime(as);
+	lock_release(coremaps_lock);
+}
+
+/*
+ * Print the statistics of the processes that exited last, oldest first
+ */
+void
+coremaps_print_exited(void) {
+	lock_acquire(coremaps_lock);
+	unsigned first = (cm_nexited > CM_EXITED_MAX) ?
+		cm_nexited - CM_EXITED_MAX : 0;
+	if (first < cm_nexited) {
+		kprintf("Recently exited:\n");
+		kprintf("%5s %-16s %6s %6s %6s %6s %9s\n", "PID", "NAME",
+			"RSS", "PEAK", "SWAP", "FAULTS", "LIFE(ms)");
+	}
+	for (unsigned i = first; i < cm_nexited; ++i) {
+		struct cm_exited* rec = &cm_exited[i % CM_EXITED_MAX];
+		kprintf("%5d %-16s %6u %6u %6u %6u %9u\n", (int)rec->pid,
+			rec->name, rec->rss, rec->rss_peak, rec->swapped,
+			rec->faults, (unsigned)rec->msecs);
+	}
+	lock_release(coremaps_lock);
+}
+
+/*
+ * Select the page replacement policy by name.
+ */
+int
+coremaps_set_policy(const char* name) {
+	cm_policy newpolicy;
+
+	if (strcmp(name, "rr") == 0) {
+		newpolicy = CM_POLICY_RR;
+	}
+	else if (strcmp(name, "clock") == 0) {
+		newpolicy = CM_POLICY_CLOCK;
+	}
+	else {
+		return EINVAL;
+	}
+
+	lock_acquire(coremaps_lock);
+	policy = newpolicy;
+	lock_release(coremaps_lock);
+	return 0;
 }
@@ -0,0 +1,130 @@
+#include "opt-A3.h"
+#if OPT_A3
+#include <types.h>
+#include <lib.h>
+#include <synch.h>
+#include <spinlock.h>
+#include <proc.h>
+#include <current.h>
+#include <thread.h>
+#include <uw-vmstats.h>
+#include <coremap.h>
+#include <oom.h>
+
+// pid of the last victim (0 for none yet); it is dying for as long as it
+// still has an address space
+static pid_t oom_victim = 0;
+
+/*
+ * The address space of p, or NULL if it has exited (or is exiting, if
+ * done is true), with pidTableLock held. It stays valid until the lock
+ * is released (see curproc_detachas).
+ */
+static
+struct addrspace*
+oom_getas(struct proc* p, bool done) {
+	spinlock_acquire(&p->p_lock);
+	struct addrspace* as = (done && p->isDone) ? NULL : p->p_addrspace;
+	spinlock_release(&p->p_lock);
+	return as;
+}
+
+/*
+ * Mark p to die on its way back to user mode
+ */
+static
+void
+oom_mark(struct proc* p) {
+	spinlock_acquire(&p->p_lock);
+	p->p_oom_killed = true;
+	spinlock_release(&p->p_lock);
+}
+
+/*
+ * Return true if the last victim still holds its memory, with
+ * pidTableLock held
+ */
+static
+bool
+oom_dying(void) {
+	struct proc* p = pidTable[oom_victim];
+	return oom_victim != 0 && p != NULL && oom_getas(p, false) != NULL;
+}
+
+/*
+ * Pick the process with the most resident and swapped pages, and mark
+ * it, with pidTableLock held. Returns its pid, or 0 if there is nothing
+ * to kill.
+ */
+static
+pid_t
+oom_select(void) {
+	pid_t victim = 0;
+	unsigned victim_pages = 0;
+
+	for (pid_t pid = 0; pid <= PID_MAX; ++pid) {
+		struct proc* p = pidTable[pid];
+		if (p == NULL) continue;
+
+		struct addrspace* as = oom_getas(p, true);
+		if (as == NULL) continue;
+
+		unsigned pages = coremaps_as_usage(as);
+		if (pages > victim_pages) {
+			victim = pid;
+			victim_pages = pages;
+		}
+	}
+	if (victim == 0) return 0;
+
+	struct proc* p = pidTable[victim];
+	oom_mark(p);
+	vmstats_inc(VMSTAT_OOM_KILL);
+	kprintf("Out of memory: killing process %d (%s), %u pages\n",
+		(int)victim, p->p_name, victim_pages);
+	return victim;
+}
+
+/*
+ * Make room for a page fault that is out of memory
+ */
+bool
+oom_kill(void) {
+	P(pidTableLock);
+	if (!oom_dying()) oom_victim = oom_select();
+	pid_t victim = oom_victim;
+	V(pidTableLock);
+
+	if (victim == 0 || victim == curproc->pid) return false;
+
+	// Let the victim run, so that it can exit and give its memory back
+	for (unsigned i = 0; i < OOM_WAIT_TRIES; ++i) {
+		thread_yield();
+
+		P(pidTableLock);
+		bool dying = (oom_victim == victim && oom_dying());
+		V(pidTableLock);
+		if (!dying) return true;
+	}
+
+	// It can't get to exit (it may be waiting for us): go ourselves
+	kprintf("Out of memory: process %d did not exit, killing process %d (%s)\n",
+		(int)victim, (int)curproc->pid, curproc->p_name);
+	oom_mark(curproc);
+	vmstats_inc(VMSTAT_OOM_KILL);
+	return false;
+}
+
+/*
+ * Was the current process picked by the OOM killer?
+ */
+bool
+oom_killed(void) {
+	if (curproc == NULL) return false;
+
+	spinlock_acquire(&curproc->p_lock);
+	bool killed = curproc->p_oom_killed;
+	spinlock_release(&curproc->p_lock);
+	return killed;
+}
+#endif /* OPT_A3 */
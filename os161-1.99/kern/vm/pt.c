@@ -14,6 +14,15 @@
 #include <mips/vm.h>
 #include <segments.h>
 #include <swapfile.h>
+#include <coremap.h>
+#include <slab.h>
+
+// Object caches for the page table directories and second level tables
+// (one page each, see pt.h)
+static struct slab_cache pt_l1_cache =
+	SLAB_CACHE_INITIALIZER("pt_l1", sizeof(struct pte*) * PT_L1_ENTRIES, 0, NULL);
+static struct slab_cache pt_l2_cache =
+	SLAB_CACHE_INITIALIZER("pt_l2", sizeof(struct pte) * PT_L2_ENTRIES, 0, NULL);
 
 /*
  * get the corresponding physical address by passing in a virtual address
@@ -23,25 +32,77 @@ int pt_getEntry(vaddr_t vaddr, struct pte* PTE) {
 
 	struct addrspace *as;
 
-	// we only care first 20 bits, the page number
-	vaddr &= PAGE_FRAME;
-
 	// should get a valid as from a valid process
 	if (curproc == NULL) return EFAULT;
 
 	as = curproc_getas();
 	if (as == NULL) return EFAULT;
 
-	seg_type type;
-	int err = get_seg_type(vaddr, as, &type);
-	if (err) return err;
+	struct pte* entry = pt_lookup(vaddr, as);
+	if (entry == NULL) return EFAULT;
+
+	*PTE = *entry;
+	return 0;
+}
+
+/*
+ * Get a pointer to the page table entry for vaddr in as, or NULL if the
+ * address is not in any segment or its second level table doesn't exist
+ * yet.
+ */
+struct pte*
+pt_lookup(vaddr_t vaddr, struct addrspace* as) {
+	KASSERT(as != NULL);
+
+	// we only care first 20 bits, the page number
+	vaddr &= PAGE_FRAME;
+
+	if (seg_find(as, vaddr) == NULL) return NULL;
+
+	struct pte* table = as->as_pt[PT_L1_INDEX(vaddr)];
+	if (table == NULL) return NULL;
+
+	return table + PT_L2_INDEX(vaddr);
+}
+
+/*
+ * An empty second level table
+ */
+static
+struct pte*
+pt_create_l2(void) {
+	struct pte* table = slab_alloc(&pt_l2_cache);
+	if (table == NULL) return NULL;
+
+	for (size_t i = 0; i < PT_L2_ENTRIES; ++i) {
+		table[i].paddr = 0;
+		table[i].swap_offset = PT_NO_SWAP;
+	}
+	return table;
+}
+
+/*
+ * Get the page table entry for vaddr in as, allocating the second level
+ * table that holds it if needed.
+ */
+int
+pt_alloc(vaddr_t vaddr, struct addrspace* as, struct pte** ret) {
+	KASSERT(as != NULL);
+
+	vaddr &= PAGE_FRAME;
+
+	if (seg_find(as, vaddr) == NULL) return EFAULT;
 
-	struct segment* seg = get_segment(type, as);
-	struct pte* pageTable = get_pt(type, as);
+	struct pte** slot = &as->as_pt[PT_L1_INDEX(vaddr)];
+	if (*slot == NULL) {
+		// Filled in before it is published, since the pageout thread
+		// may be looking at this address space
+		struct pte* table = pt_create_l2();
+		if (table == NULL) return ENOMEM;
+		*slot = table;
+	}
 
-	// TODO: Account for stack
-	int index = (vaddr - seg->vbase) / PAGE_SIZE;
-	*PTE = pageTable[index];
+	*ret = *slot + PT_L2_INDEX(vaddr);
 	return 0;
 }
 
@@ -70,19 +131,15 @@ pt_setEntry(vaddr_t vaddr, paddr_t paddr) {
 	// the valid bit :)
 	paddr |= PT_VALID;
 
-	seg_type type;
-	int err = get_seg_type(vaddr, as, &type);
-	if (err) return err;
-
-	struct segment* seg = get_segment(type, as);
-	struct pte* pageTable = get_pt(type, as);
+	// The fault handler made sure the second level table exists
+	struct pte* entry = pt_lookup(vaddr, as);
+	if (entry == NULL) return EFAULT;
 
-	// Index in the page table
-	int index = (vaddr - seg->vbase) / PAGE_SIZE;
-	// Keep all old flags (they are initialized at start)
-	paddr |= (pageTable[index].paddr) & ~PAGE_FRAME;
-	pageTable[index].paddr = paddr;
-	pageTable[index].swap_offset = 0xffff;
+	// Keep all old flags
+	paddr |= entry->paddr & ~PAGE_FRAME;
+	entry->paddr = paddr;
+	// Keep the swap offset: until the page is dirtied, the copy in
+	// the swap file is still good and we can evict without a write
 	return 0;
 }
 
@@ -90,25 +147,26 @@ pt_setEntry(vaddr_t vaddr, paddr_t paddr) {
  * use VOP_READ to load a page
  */
 int
-pt_loadPage(vaddr_t vaddr, paddr_t paddr, uint16_t swap_offset, struct addrspace *as, seg_type type) {
+pt_loadPage(vaddr_t vaddr, paddr_t paddr, uint32_t swap_offset, struct addrspace *as, seg_type type) {
 	
-	if(swap_offset != 0xffff){
+	if(swap_offset != PT_NO_SWAP){
 		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
 		// load from swapfile
-		int result = swapin_mem(swap_offset,paddr);
+		int result = coremaps_swapin(as, vaddr, paddr, swap_offset);
 		vmstats_inc(VMSTAT_SWAP_FILE_READ);
 		return result;
 	}
 	
-	if (type == STACK) {
-		// Does nothing for stack (page already zeroed)
+	if (type == STACK || type == HEAP) {
+		// Does nothing for stack and heap (page already zeroed)
 		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
 		return 0;
 	}
 	
 	vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
 	
-	struct segment* seg = get_segment(type, as);
+	struct segment* seg = seg_find(as, vaddr);
+	KASSERT(seg != NULL);
 
 	// Offset into the segment
 	size_t seg_offset = vaddr - seg->vbase;
@@ -130,50 +188,8 @@ pt_loadPage(vaddr_t vaddr, paddr_t paddr, uint16_t swap_offset, struct addrspace
 	// TODO: Does this count as a "Zero" stat?
 	if (readsize == 0) return 0;
 
-	/*
-	 * We are pretending that we are writing to kernel space even though
-	 * we're writing to the physical address of a user space virtual address.
-	 * This is a bit of a hack, but it is necessary so that we can't TLB fault
-	 * in this function, since this is called from within the fault
-	 * handler itself.
-	 */
-
-	struct iovec iov;
-	struct uio u;
-
-	// Net file offset, as opposed to segment file offset
-	size_t file_offset = seg_offset + seg->file_offset;
-	void* kvaddr = (void*)PADDR_TO_KVADDR(paddr);
-	uio_kinit(&iov, &u, kvaddr, readsize, file_offset, UIO_READ);
-
-	int result = VOP_READ(as->as_vn, &u);
-	if (result) return result;
-
-	if (u.uio_resid != 0) {
-		/* short read; problem with executable? */
-		kprintf("ELF: short read on segment - file truncated?\n");
-		return ENOEXEC;
-	}
-
-	return 0;
-}
-
-/*
- * Get the page table for this vaddr, or NULL if doesn't exist.
- */
-struct pte*
-get_pt(seg_type type, struct addrspace* as) {
-
-	switch(type) {
-		case TEXT:
-			return as->text_pt;
-		case DATA:
-			return as->data_pt;
-		case STACK:
-			return as->stack_pt;
-	}
-	// Invalid virtual address
-	return NULL;
+	// Read it, along with the pages that follow it
+	return coremaps_faultaround(as, seg, vaddr, paddr);
 }
 
 /*
@@ -181,45 +197,65 @@ get_pt(seg_type type, struct addrspace* as) {
 `* meanwhile, invalidate tlb if applicable
  */
 void
-pt_invalid(vaddr_t vaddr, struct addrspace* as,uint16_t swap_offset){
+pt_invalid(vaddr_t vaddr, struct addrspace* as,uint32_t swap_offset){
 
 	KASSERT(as != NULL);
 
-	//get the table
-	seg_type type;
-	get_seg_type(vaddr, as, &type);
-
-	struct segment* seg = get_segment(type, as);
-	struct pte* pageTable = get_pt(type, as);
+	//get the entry
+	struct pte* entry = pt_lookup(vaddr, as);
+	KASSERT(entry != NULL);
 
-	// Index in the page table
-	int index = (vaddr - seg->vbase) / PAGE_SIZE;
-
-	// invalid that entry
-	paddr_t paddr = pageTable[index].paddr;
-	paddr &= ~(PT_VALID);
-	pageTable[index].paddr = paddr;
-	pageTable[index].swap_offset = swap_offset; // invalid and swap out
+	// invalid that entry (it is no longer dirty either)
+	paddr_t paddr = entry->paddr;
+	paddr &= ~(PT_VALID | PT_DIRTY | PT_PREFETCH);
+	entry->paddr = paddr;
+	entry->swap_offset = swap_offset; // invalid and swap out
 
 	// we don't know if its in tlb
-	if(curproc != NULL && curproc_getas()==as){
-		struct tlbshootdown tlbs;
-		tlbs.ts_vaddr = vaddr;
-		vm_tlbshootdown(&tlbs);
-	}
+	tlb_invalidate(vaddr, as);
 
 }
 
-struct pte*
-create_pt(size_t npages, int flags) {
-	struct pte* pt = kmalloc(sizeof(struct pte) * npages);
+/*
+ * Create an empty page table directory
+ */
+struct pte**
+pt_create(void) {
+	struct pte** pt = slab_alloc(&pt_l1_cache);
 	if (pt == NULL) return NULL;
 
-	for (size_t i = 0; i < npages; ++i) {
-		pt[i].paddr = flags;
-		pt[i].swap_offset = 0xffff;
+	for (size_t i = 0; i < PT_L1_ENTRIES; ++i) {
+		pt[i] = NULL;
 	}
 	return pt;
 }
 
+/*
+ * Free a page table directory and its second level tables. The pages
+ * they map must have been released already (see coremaps_as_free).
+ */
+void
+pt_destroy(struct pte** pt) {
+	if (pt == NULL) return;
+
+	for (size_t i = 0; i < PT_L1_ENTRIES; ++i) {
+		if (pt[i] != NULL) slab_free(&pt_l2_cache, pt[i]);
+	}
+	slab_free(&pt_l1_cache, pt);
+}
+
+/*
+ * Give new a second level table wherever old has one
+ */
+int
+pt_copy_tables(struct addrspace* old, struct addrspace* new) {
+	for (size_t i = 0; i < PT_L1_ENTRIES; ++i) {
+		if (old->as_pt[i] == NULL || new->as_pt[i] != NULL) continue;
+
+		new->as_pt[i] = pt_create_l2();
+		if (new->as_pt[i] == NULL) return ENOMEM;
+	}
+	return 0;
+}
+
 #endif /* OPT-A3 */
@@ -4,6 +4,10 @@
 #include <kern/errno.h>
 #include <segments.h>
 #include <lib.h>
+#include <slab.h>
+
+struct slab_cache segment_cache =
+	SLAB_CACHE_INITIALIZER("segment", sizeof(struct segment), 0, NULL);
 
 // Get the type of the vaddr, return error if so
 int
@@ -11,36 +15,83 @@ get_seg_type(vaddr_t vaddr, struct addrspace* as, seg_type* type) {
 	//error check
 	KASSERT(type);
 
-	if (vaddr >= as->text_seg->vbase && vaddr < as->text_seg->vtop)
-		*type = TEXT;
-	else if (vaddr >= as->data_seg->vbase && vaddr < as->data_seg->vtop)
-		*type = DATA;
-	else if (vaddr >= STACK_BASE && vaddr < USERSTACK)
-		*type = STACK;
-	else
-		return EFAULT;
+	struct segment* seg = seg_find(as, vaddr);
+	if (seg == NULL) return EFAULT;
+
+	*type = seg->type;
 	return 0;
 }
 
 struct segment*
-get_segment(seg_type type, struct addrspace* as) {
-	switch(type) {
-		case TEXT:
-			return as->text_seg;
-		case DATA:
-			return as->data_seg;
-		case STACK:
-			// Recall: This segment not in ELF file
-			return as->stack_seg;
+seg_find(struct addrspace* as, vaddr_t vaddr) {
+	for (struct segment* seg = as->as_segs; seg != NULL; seg = seg->next) {
+		if (vaddr >= seg->vbase && vaddr < seg->vtop) return seg;
 	}
 	return NULL;
 }
 
+int
+seg_add(struct addrspace* as, struct segment* seg) {
+	// User space only (the heap starts out empty)
+	if (seg->vtop < seg->vbase || seg->vtop > USERSPACETOP) return EINVAL;
+
+	for (struct segment* other = as->as_segs; other != NULL;
+			other = other->next) {
+		if (seg->vbase < other->vtop && other->vbase < seg->vtop) {
+			return EINVAL;
+		}
+	}
+
+	seg->next = as->as_segs;
+	as->as_segs = seg;
+	return 0;
+}
+
+void
+seg_remove(struct addrspace* as, struct segment* seg) {
+	struct segment** link = &as->as_segs;
+	while (*link != NULL && *link != seg) link = &(*link)->next;
+	KASSERT(*link == seg);
+	*link = seg->next;
+	seg->next = NULL;
+}
+
+bool
+seg_writeable(struct segment* seg) {
+	switch (seg->type) {
+		case TEXT:
+			return false;
+		case MMAP:
+			return (seg->flags & SEG_WRITE) != 0;
+		default:
+			return true;
+	}
+}
+
+bool
+seg_cached(struct segment* seg) {
+	// Private mappings are written in place, like the data segment
+	return seg->type == TEXT || seg_shared_file(seg);
+}
+
+bool
+seg_shared_file(struct segment* seg) {
+	return seg->type == MMAP && (seg->flags & SEG_SHARED);
+}
+
+bool
+seg_demand_zero(struct segment* seg, vaddr_t vaddr) {
+	if (seg->type == STACK || seg->type == HEAP) return true;
+	// Past the end of the file (bss). Cached pages may be written
+	// back to the file, so they always get their own frame.
+	return !seg_cached(seg) && vaddr - seg->vbase >= seg->filesize;
+}
+
 struct segment*
 seg_create(seg_type type, off_t offset, size_t filesz, size_t sz,
 		vaddr_t vbase) {
 
-	struct segment* seg = kmalloc(sizeof(struct segment));
+	struct segment* seg = slab_alloc(&segment_cache);
 	if (seg == NULL) return NULL;
 
 	/* Align the region. First, the base... */
@@ -56,6 +107,9 @@ seg_create(seg_type type, off_t offset, size_t filesz, size_t sz,
 	seg->filesize = filesz;
 	seg->file_offset = offset;
 	seg->npages = (seg->vtop - seg->vbase) / PAGE_SIZE;
+	seg->vn = NULL;
+	seg->flags = 0;
+	seg->next = NULL;
 
 	return seg;
 }
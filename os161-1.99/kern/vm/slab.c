@@ -0,0 +1,344 @@
+#include "opt-A3.h"
+#if OPT_A3
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <vm.h>
+#include <slab.h>
+
+// Header at the start of each one-page slab
+struct slab {
+	struct slab* sl_next;
+	struct slab* sl_prev;
+	// free objects, linked through sc_link
+	void* sl_free;
+	// objects not on sl_free (handed out, or in a magazine)
+	unsigned sl_inuse;
+	struct slab_cache* sl_cache;
+};
+
+// every cache that has been used (they are never destroyed)
+static struct slab_cache* slab_caches = NULL;
+static struct spinlock slab_caches_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * The link to the next free object, kept inside a free object
+ */
+static inline
+void**
+slab_link(struct slab_cache* sc, void* obj) {
+	return (void**)((char*)obj + sc->sc_link);
+}
+
+/*
+ * Work out the layout of the cache on its first use, and add it to the
+ * list of caches
+ */
+static
+void
+slab_setup(struct slab_cache* sc) {
+	size_t align = sc->sc_align;
+	if (align < sizeof(void*)) align = sizeof(void*);
+	KASSERT((align & (align - 1)) == 0);
+
+	// The free list link goes after the object if there is a
+	// constructor, so that it doesn't overwrite what it set up
+	size_t size = ROUNDUP(sc->sc_size, sizeof(void*));
+	size_t link = 0;
+	if (sc->sc_ctor != NULL) {
+		link = size;
+		size += sizeof(void*);
+	}
+	size_t stride = ROUNDUP(size, align);
+	size_t offset = ROUNDUP(sizeof(struct slab), align);
+	unsigned perslab = (PAGE_SIZE - offset) / stride;
+
+	spinlock_acquire(&sc->sc_lock);
+	if (sc->sc_ready) {
+		spinlock_release(&sc->sc_lock);
+		return;
+	}
+	sc->sc_offset = offset;
+	sc->sc_stride = stride;
+	sc->sc_link = link;
+	if (perslab >= 2) {
+		sc->sc_perslab = perslab;
+		sc->sc_npages = 1;
+	}
+	else {
+		sc->sc_perslab = 0;
+		sc->sc_npages = DIVROUNDUP(stride, PAGE_SIZE);
+	}
+	sc->sc_ready = true;
+	spinlock_release(&sc->sc_lock);
+
+	spinlock_acquire(&slab_caches_lock);
+	sc->sc_next = slab_caches;
+	slab_caches = sc;
+	spinlock_release(&slab_caches_lock);
+}
+
+/*
+ * This CPU's magazine, or NULL this early in boot
+ */
+static
+struct slab_magazine*
+slab_mag(struct slab_cache* sc) {
+	if (!CURCPU_EXISTS()) return NULL;
+	return &sc->sc_mags[curcpu->c_number];
+}
+
+/*
+ * Objects a magazine of the cache may hold
+ */
+static inline
+unsigned
+slab_mag_limit(struct slab_cache* sc) {
+	return (sc->sc_perslab != 0) ? SLAB_MAG_SIZE : SLAB_MAG_SIZE / 4;
+}
+
+/*
+ * Unlink a slab from the partial list, with sc_lock held
+ */
+static
+void
+slab_unlink(struct slab_cache* sc, struct slab* sl) {
+	if (sl->sl_prev != NULL) sl->sl_prev->sl_next = sl->sl_next;
+	else sc->sc_partial = sl->sl_next;
+	if (sl->sl_next != NULL) sl->sl_next->sl_prev = sl->sl_prev;
+	sl->sl_next = sl->sl_prev = NULL;
+}
+
+/*
+ * Put a slab on the partial list, with sc_lock held
+ */
+static
+void
+slab_insert(struct slab_cache* sc, struct slab* sl) {
+	sl->sl_prev = NULL;
+	sl->sl_next = sc->sc_partial;
+	if (sc->sc_partial != NULL) sc->sc_partial->sl_prev = sl;
+	sc->sc_partial = sl;
+}
+
+/*
+ * Take a free object from the partial slabs, with sc_lock held. NULL if
+ * there is none.
+ */
+static
+void*
+slab_take(struct slab_cache* sc) {
+	struct slab* sl = sc->sc_partial;
+	if (sl == NULL) return NULL;
+
+	void* obj = sl->sl_free;
+	KASSERT(obj != NULL);
+	sl->sl_free = *slab_link(sc, obj);
+	if (sl->sl_inuse == 0) sc->sc_nempty -= 1;
+	sl->sl_inuse += 1;
+	if (sl->sl_free == NULL) {
+		// Full: it comes back once an object is freed
+		slab_unlink(sc, sl);
+	}
+	sc->sc_allocs += 1;
+	return obj;
+}
+
+/*
+ * Make a new one-page slab, without any lock held (it may have to wait
+ * for a frame)
+ */
+static
+struct slab*
+slab_grow(struct slab_cache* sc) {
+	vaddr_t page = alloc_kpages(1);
+	if (page == 0) return NULL;
+
+	struct slab* sl = (struct slab*)page;
+	sl->sl_next = sl->sl_prev = NULL;
+	sl->sl_free = NULL;
+	sl->sl_inuse = 0;
+	sl->sl_cache = sc;
+
+	// Link the objects in address order
+	for (unsigned i = sc->sc_perslab; i > 0; --i) {
+		void* obj = (char*)page + sc->sc_offset + (i - 1) * sc->sc_stride;
+		if (sc->sc_ctor != NULL) sc->sc_ctor(obj);
+		*slab_link(sc, obj) = sl->sl_free;
+		sl->sl_free = obj;
+	}
+	return sl;
+}
+
+/*
+ * Get an object past the magazines
+ */
+static
+void*
+slab_alloc_slow(struct slab_cache* sc) {
+	if (sc->sc_perslab == 0) {
+		// Pages of its own
+		vaddr_t obj = alloc_kpages(sc->sc_npages);
+		if (obj == 0) return NULL;
+		if (sc->sc_ctor != NULL) sc->sc_ctor((void*)obj);
+
+		spinlock_acquire(&sc->sc_lock);
+		sc->sc_nslabs += 1;
+		sc->sc_allocs += 1;
+		spinlock_release(&sc->sc_lock);
+		return (void*)obj;
+	}
+
+	spinlock_acquire(&sc->sc_lock);
+	void* obj = slab_take(sc);
+	spinlock_release(&sc->sc_lock);
+	if (obj != NULL) return obj;
+
+	struct slab* sl = slab_grow(sc);
+	if (sl == NULL) return NULL;
+
+	spinlock_acquire(&sc->sc_lock);
+	sc->sc_nslabs += 1;
+	sc->sc_nempty += 1;
+	slab_insert(sc, sl);
+	obj = slab_take(sc);
+	spinlock_release(&sc->sc_lock);
+	return obj;
+}
+
+/*
+ * Get an object from the cache
+ */
+void*
+slab_alloc(struct slab_cache* sc) {
+	if (!sc->sc_ready) slab_setup(sc);
+
+	struct slab_magazine* mag = slab_mag(sc);
+	if (mag != NULL) {
+		void* obj = NULL;
+		spinlock_acquire(&mag->mag_lock);
+		if (mag->mag_count > 0) {
+			mag->mag_count -= 1;
+			obj = mag->mag_objs[mag->mag_count];
+			mag->mag_hits += 1;
+		}
+		spinlock_release(&mag->mag_lock);
+		if (obj != NULL) return obj;
+	}
+
+	return slab_alloc_slow(sc);
+}
+
+/*
+ * Give an object back to its slab, past the magazines
+ */
+static
+void
+slab_free_slow(struct slab_cache* sc, void* obj) {
+	if (sc->sc_perslab == 0) {
+		spinlock_acquire(&sc->sc_lock);
+		sc->sc_nslabs -= 1;
+		sc->sc_frees += 1;
+		spinlock_release(&sc->sc_lock);
+		free_kpages((vaddr_t)obj);
+		return;
+	}
+
+	struct slab* sl = (struct slab*)((vaddr_t)obj & PAGE_FRAME);
+	KASSERT(sl->sl_cache == sc);
+	KASSERT(sl->sl_inuse > 0);
+
+	struct slab* release = NULL;
+	spinlock_acquire(&sc->sc_lock);
+	if (sl->sl_free == NULL) {
+		// Was full
+		slab_insert(sc, sl);
+	}
+	*slab_link(sc, obj) = sl->sl_free;
+	sl->sl_free = obj;
+	sl->sl_inuse -= 1;
+	sc->sc_frees += 1;
+
+	if (sl->sl_inuse == 0) {
+		if (sc->sc_nempty < SLAB_KEEP_EMPTY) {
+			sc->sc_nempty += 1;
+		}
+		else {
+			slab_unlink(sc, sl);
+			sc->sc_nslabs -= 1;
+			release = sl;
+		}
+	}
+	spinlock_release(&sc->sc_lock);
+
+	if (release != NULL) free_kpages((vaddr_t)release);
+}
+
+/*
+ * Give an object back to the cache
+ */
+void
+slab_free(struct slab_cache* sc, void* obj) {
+	if (obj == NULL) return;
+	KASSERT(sc->sc_ready);
+
+	struct slab_magazine* mag = slab_mag(sc);
+	if (mag != NULL) {
+		bool kept = false;
+		spinlock_acquire(&mag->mag_lock);
+		if (mag->mag_count < slab_mag_limit(sc)) {
+			mag->mag_objs[mag->mag_count] = obj;
+			mag->mag_count += 1;
+			mag->mag_frees += 1;
+			kept = true;
+		}
+		spinlock_release(&mag->mag_lock);
+		if (kept) return;
+	}
+
+	slab_free_slow(sc, obj);
+}
+
+/*
+ * Print one line per cache: object size, objects per slab, slabs (or
+ * big objects), objects in use and in the magazines, allocations, and
+ * how many of those the magazines served
+ */
+void
+slab_printstats(void) {
+	kprintf("Object caches:\n");
+	kprintf("%-12s %6s %5s %6s %6s %5s %8s %5s\n", "NAME", "SIZE",
+		"SLAB", "SLABS", "INUSE", "MAG", "ALLOCS", "HIT%");
+
+	spinlock_acquire(&slab_caches_lock);
+	struct slab_cache* sc = slab_caches;
+	spinlock_release(&slab_caches_lock);
+
+	// Caches are only ever added at the front, so the rest of the list
+	// can be walked without the lock
+	for (; sc != NULL; sc = sc->sc_next) {
+		unsigned hits = 0, magfrees = 0, cached = 0;
+		for (unsigned cpu = 0; cpu < MAXCPUS; ++cpu) {
+			struct slab_magazine* mag = &sc->sc_mags[cpu];
+			spinlock_acquire(&mag->mag_lock);
+			hits += mag->mag_hits;
+			magfrees += mag->mag_frees;
+			cached += mag->mag_count;
+			spinlock_release(&mag->mag_lock);
+		}
+
+		spinlock_acquire(&sc->sc_lock);
+		unsigned nslabs = sc->sc_nslabs;
+		unsigned allocs = sc->sc_allocs + hits;
+		unsigned frees = sc->sc_frees + magfrees;
+		spinlock_release(&sc->sc_lock);
+
+		kprintf("%-12s %6u %5u %6u %6u %5u %8u %4u%%\n", sc->sc_name,
+			(unsigned)sc->sc_size, sc->sc_perslab, nslabs,
+			allocs - frees, cached, allocs,
+			allocs ? hits * 100 / allocs : 0);
+	}
+}
+#endif /* OPT_A3 */
@@ -3,19 +3,210 @@
 #include <swapfile.h>
 #include <vfs.h>
 #include <kern/fcntl.h>
+#include <kern/errno.h>
 #include <synch.h>
 #include <uw-vmstats.h>
 #include <uio.h>
 #include <vnode.h>
+#include <bitmap.h>
+#include <zswap.h>
+#include <kern/stat.h>
+#include <clock.h>
 
 static struct lock* swap_mutex;
 
-static uint16_t max_pages = SWAPFILE_PAGES;
+// Number of slots in the swap file (see swap_resize)
+static unsigned max_pages = SWAPFILE_PAGES;
+
+// Number of slots nobody is using
+static unsigned free_pages = SWAPFILE_PAGES;
+
+// Where to start looking for a free slot (next fit)
+static unsigned next_slot = 0;
 
 static struct vnode* swap_vn;
 
-// Max 9 MB swap file
-static bool swaptable[SWAPFILE_PAGES];
+// What swap_vn is: the swap file, or a raw disk device (see swap_setdev),
+// and for a device, the number of pages it holds (0 for the file, which
+// grows as needed)
+static char* swap_path = NULL;
+static unsigned swap_dev_pages = 0;
+
+// Slots that are in use
+static struct bitmap* swapmap;
+
+// Number of page tables referring to each slot in use.
+// Slots are shared when a process forks with pages in swap.
+static uint16_t* swaprefs;
+
+/*
+	take a free slot, with the lock held
+	return ENOMEM if the swap file is full
+*/
+static
+int
+swap_alloc(uint32_t* pageIndex){
+	KASSERT(lock_do_i_hold(swap_mutex));
+
+	if (free_pages == 0) return ENOMEM;
+
+	unsigned index;
+	int result = bitmap_alloc_from(swapmap, next_slot, &index);
+	// free_pages says there is one
+	KASSERT(result == 0);
+
+	swaprefs[index] = 1;
+	free_pages -= 1;
+	next_slot = (index + 1) % max_pages;
+
+	*pageIndex = index;
+	return 0;
+}
+
+/*
+	drop one reference to a slot, with the lock held
+*/
+static
+void
+swap_release(uint32_t pageIndex){
+	KASSERT(lock_do_i_hold(swap_mutex));
+	KASSERT(pageIndex < max_pages);
+	KASSERT(swaprefs[pageIndex] > 0);
+
+	swaprefs[pageIndex] -= 1;
+	if (swaprefs[pageIndex] == 0) {
+		bitmap_unmark(swapmap, pageIndex);
+		free_pages += 1;
+		zswap_invalidate(pageIndex);
+	}
+}
+
+/*
+	take npages free slots in a row, with the lock held
+	return ENOMEM if there is no such extent
+*/
+static
+int
+swap_alloc_extent(unsigned npages, uint32_t* start){
+	KASSERT(lock_do_i_hold(swap_mutex));
+
+	if (free_pages < npages) return ENOMEM;
+
+	// Next fit again, but an extent can't wrap around the end of the file
+	unsigned slot = next_slot;
+	unsigned run = 0;
+	for (unsigned i = 0; i < max_pages + npages; ++i, ++slot) {
+		if (slot >= max_pages) {
+			slot = 0;
+			run = 0;
+		}
+		if (bitmap_isset(swapmap, slot)) {
+			run = 0;
+			continue;
+		}
+		run += 1;
+		if (run == npages) {
+			*start = slot + 1 - npages;
+			for (unsigned j = *start; j <= slot; ++j) {
+				bitmap_mark(swapmap, j);
+				swaprefs[j] = 1;
+			}
+			free_pages -= npages;
+			next_slot = (slot + 1) % max_pages;
+			return 0;
+		}
+	}
+	return ENOMEM;
+}
+
+/*
+	move npages pages between memory and the slots starting at start
+	in the swap file, with a single uio (one iovec per page)
+
+	on a raw device this goes straight to its d_io, which moves all of
+	the sectors in one call, with no file system (or vfs_biglock) on
+	the way
+*/
+static
+int
+swap_disk_io(uint32_t start, const paddr_t* paddrs, unsigned npages, enum uio_rw rw){
+	KASSERT(swap_vn != NULL);
+	KASSERT(npages > 0 && npages <= SWAP_CLUSTER);
+	KASSERT(start + npages <= max_pages);
+
+	struct iovec iov[SWAP_CLUSTER];
+	struct uio u;
+
+	for (unsigned i = 0; i < npages; ++i) {
+		KASSERT((paddrs[i] & PAGE_FRAME) == paddrs[i]);
+		iov[i].iov_kbase = (void*)PADDR_TO_KVADDR(paddrs[i]);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	u.uio_iov = iov;
+	u.uio_iovcnt = npages;
+	u.uio_offset = (off_t)start * PAGE_SIZE;
+	u.uio_resid = npages * PAGE_SIZE;
+	u.uio_segflg = UIO_SYSSPACE;
+	u.uio_rw = rw;
+	u.uio_space = NULL;
+
+	int result;
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vn, &u);
+	}
+	else {
+		result = VOP_WRITE(swap_vn, &u);
+	}
+	if (result) {
+		return result;
+	}
+
+	if (u.uio_resid != 0) {
+		// Short read/write - some failure?
+		kprintf("SWAPFILE: Short %s!\n", rw == UIO_READ ? "read" : "write");
+		return EIO;
+	}
+	return 0;
+}
+
+/*
+	move npages pages between memory and the slots starting at start,
+	through the compressed cache: the pages it takes (or has) don't go
+	to the swap file at all, the others are moved in runs, one uio each
+*/
+static
+int
+swap_io(uint32_t start, const paddr_t* paddrs, unsigned npages, enum uio_rw rw){
+	unsigned i = 0;
+	while (i < npages) {
+		// Find the end of the run of pages that need the disk
+		unsigned end = i;
+		while (end < npages && !(rw == UIO_READ ?
+				zswap_load(start + end, paddrs[end]) :
+				zswap_store(start + end, paddrs[end]))) {
+			end += 1;
+		}
+
+		if (end > i) {
+			int result = swap_disk_io(start + i, paddrs + i, end - i, rw);
+			if (result) {
+				return result;
+			}
+		}
+		// Page `end` (if any) was taken care of by the cache
+		i = end + 1;
+	}
+	return 0;
+}
+
+/*
+	write the page at paddr straight to a slot of the swap file (used to
+	make room in the compressed cache)
+*/
+int
+swap_disk_write(uint32_t pageIndex, paddr_t paddr){
+	return swap_disk_io(pageIndex, &paddr, 1, UIO_WRITE);
+}
 
 /*
 	takes in the source and destination
@@ -25,31 +216,87 @@ static bool swaptable[SWAPFILE_PAGES];
 	loadpage does takes in an as
 */
 int
-swapin_mem(uint16_t pageIndex, paddr_t p_dest){
+swapin_mem(uint32_t pageIndex, paddr_t p_dest){
 	// load from disk to memory similar to load page
 	KASSERT((p_dest&PAGE_FRAME) == p_dest);
-	KASSERT(swap_vn != NULL);
 
-	struct iovec iov; // buffer
-	struct uio u;
+	// The slot is not freed here: the page table keeps it for as long
+	// as the page stays clean, so that we never write the same data twice
+	return swap_io(pageIndex, &p_dest, 1, UIO_READ);
+}
 
-	off_t file_offset = pageIndex * PAGE_SIZE;
+/*
+	read the pages in slots start .. start+npages-1 into the frames in
+	paddrs (the first one is the page that faulted, the rest readahead)
+*/
+int
+swapin_cluster(uint32_t start, const paddr_t* paddrs, unsigned npages){
+	if (npages > 1) {
+		vmstats_inc(VMSTAT_SWAP_CLUSTER_READ);
+		for (unsigned i = 1; i < npages; ++i) {
+			vmstats_inc(VMSTAT_SWAP_READAHEAD);
+		}
+	}
+	return swap_io(start, paddrs, npages, UIO_READ);
+}
 
-	void* kvaddr = (void*)PADDR_TO_KVADDR(p_dest);
-	uio_kinit(&iov, &u, kvaddr, PAGE_SIZE, file_offset, UIO_READ);
-	int result = VOP_READ(swap_vn, &u);
+/*
+	find a slot that only the caller refers to, to write the page that
+	had slot old (or PT_NO_SWAP) to: old itself if it is ours alone,
+	otherwise a new one. the old slot is not released here, since the
+	write may still fail (see swap_replace)
 
-	if (result) {
-		return result;
+	return ENOMEM if the swap file is full
+*/
+int
+swap_reserve(uint32_t old, uint32_t *pageIndex){
+	lock_acquire(swap_mutex);
+
+	if (old != PT_NO_SWAP) {
+		KASSERT(old < max_pages);
+		KASSERT(swaprefs[old] > 0);
+		if (swaprefs[old] == 1) {
+			// Reuse the slot that we already own
+			lock_release(swap_mutex);
+			*pageIndex = old;
+			return 0;
+		}
 	}
 
-	if (u.uio_resid != 0) {
-		// Short read - some failure?
-		kprintf("SWAPFILE: Short read!\n");
-		return 1;
+	int result = swap_alloc(pageIndex);
+	lock_release(swap_mutex);
+	return result ? ENOMEM : 0;
+}
+
+/*
+	the page that had slot old now lives in pageIndex (from swap_reserve):
+	drop the reference to the old slot (someone else may still need its
+	contents)
+*/
+void
+swap_replace(uint32_t old, uint32_t pageIndex){
+	if (old != PT_NO_SWAP && old != pageIndex) {
+		swap_free(old);
 	}
+}
+
+/*
+	write the page at paddr to a slot returned by swap_reserve
+*/
+int
+swap_write(uint32_t pageIndex, paddr_t paddr){
+	KASSERT((paddr & PAGE_FRAME) == paddr); // should be page index
+
+	vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
 
-	swap_free(pageIndex);
+	// Write the page to the swap file
+	int result = swap_io(pageIndex, &paddr, 1, UIO_WRITE);
+	if (result == EIO) {
+		return result;
+	}
+	if (result) {
+		panic("Swap write failed!\n");
+	}
 	return 0;
 }
 
@@ -58,72 +305,158 @@ swapin_mem(uint16_t pageIndex, paddr_t p_dest){
 	read only, we can just ignore the above logic should be in getppages?
 
 	clean page (zero) is called after getppages
+
+	if *swap_page is already a slot (the page was swapped in before and has
+	since been dirtied) that slot is overwritten, otherwise a new one is taken
+
+	return ENOMEM if the swap file is full, or EIO if the write fails
+	(and leave *swap_page alone either way)
 */
 int
-swapout_mem(paddr_t paddr, uint16_t *swap_page){
-
-	KASSERT((paddr & PAGE_FRAME) == paddr); // should be page index
+swapout_mem(paddr_t paddr, uint32_t *swap_page){
+	uint32_t pageIndex;
 
-	vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+	int result = swap_reserve(*swap_page, &pageIndex);
+	if (result) {
+		return result;
+	}
 
-	lock_acquire(swap_mutex);
+	result = swap_write(pageIndex, paddr);
+	if (result) {
+		// The old slot is still ours, give back the new one
+		if (pageIndex != *swap_page) swap_free(pageIndex);
+		return result;
+	}
 
-	struct iovec iov; // buffer
-	struct uio u;
-	int pageIndex = -1;
+	swap_replace(*swap_page, pageIndex);
+	*swap_page = pageIndex;
+	return 0;
+}
 
-	for(int i = 0; i < max_pages; i++){
-		// Skip filled pages
-		if (!swaptable[i]) continue;
+/*
+	write several pages that are evicted together to one extent of
+	the swap file, with a single write
 
-		// Allocate page
-		pageIndex = i;
-		swaptable[pageIndex] = false;
-		break;
+	swap_pages[i] is the slot page i had before (or PT_NO_SWAP) and is
+	replaced by its new slot. return ENOMEM (and change nothing) if there
+	is no free extent that is large enough
+*/
+int
+swapout_cluster(const paddr_t* paddrs, uint32_t* swap_pages, unsigned npages){
+	if (npages == 1) {
+		return swapout_mem(paddrs[0], swap_pages);
 	}
 
-	// We don't need the lock for VOP_WRITE
+	uint32_t start;
+	lock_acquire(swap_mutex);
+	int result = swap_alloc_extent(npages, &start);
 	lock_release(swap_mutex);
+	if (result) {
+		return result;
+	}
 
-	// We didn't find a free page - panic
-	if (pageIndex == -1) panic("Out of swap space!\n");
-
-	off_t file_offset = pageIndex * PAGE_SIZE;
-	void* kvaddr = (void*)PADDR_TO_KVADDR(paddr);
-	uio_kinit(&iov, &u, kvaddr, PAGE_SIZE, file_offset, UIO_WRITE);
+	vmstats_inc(VMSTAT_SWAP_CLUSTER_WRITE);
+	for (unsigned i = 0; i < npages; ++i) {
+		vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+		vmstats_inc(VMSTAT_SWAP_CLUSTER_PAGE);
+	}
 
-	// Write the page to the swap file
-	int result = VOP_WRITE(swap_vn, &u);
+	result = swap_io(start, paddrs, npages, UIO_WRITE);
+	if (result == EIO) {
+		// Give the extent back, the old copies are still there
+		lock_acquire(swap_mutex);
+		for (unsigned i = 0; i < npages; ++i) {
+			swap_release(start + i);
+		}
+		lock_release(swap_mutex);
+		return result;
+	}
 	if (result) {
 		panic("Swap write failed!\n");
 	}
 
-	if (u.uio_resid != 0) {
-		kprintf("SWAPFILE: Short write!\n");
-		return 1;
+	lock_acquire(swap_mutex);
+	for (unsigned i = 0; i < npages; ++i) {
+		// The new copy replaces the old one
+		if (swap_pages[i] != PT_NO_SWAP) swap_release(swap_pages[i]);
+		swap_pages[i] = start + i;
 	}
-
-	// maybe decrement the frame-allocation number
-	// the total amount that a process can call "getppages"
-
-	*swap_page = pageIndex;
+	lock_release(swap_mutex);
 	return 0;
 }
 
 /*
 	free a page in the swap file
+	(drop one reference; the slot is free once nobody refers to it)
 */
 void
-swap_free(uint16_t pageIndex){
-
-	KASSERT(pageIndex < SWAPFILE_PAGES);
+swap_free(uint32_t pageIndex){
 
 	// do it for page table2 and stack
 	lock_acquire(swap_mutex);
-	swaptable[pageIndex] = true;
+	swap_release(pageIndex);
 	lock_release(swap_mutex);
 }
 
+/*
+	add a reference to a page in the swap file (used by fork)
+*/
+void
+swap_dup(uint32_t pageIndex){
+
+	lock_acquire(swap_mutex);
+	KASSERT(pageIndex < max_pages);
+	KASSERT(swaprefs[pageIndex] > 0);
+	swaprefs[pageIndex] += 1;
+	lock_release(swap_mutex);
+}
+
+/*
+	change the number of slots in the swap file
+	only allowed while nothing is swapped out (i.e. from the boot menu)
+*/
+int
+swap_resize(unsigned npages){
+	if (npages == 0) return EINVAL;
+	// A device can't grow like the file does
+	if (swap_dev_pages != 0 && npages > swap_dev_pages) return EINVAL;
+
+	// Allocate before taking the lock: kmalloc may have to swap
+	struct bitmap* newmap = bitmap_create(npages);
+	if (newmap == NULL) return ENOMEM;
+	uint16_t* newrefs = kmalloc(sizeof(uint16_t) * npages);
+	if (newrefs == NULL) {
+		bitmap_destroy(newmap);
+		return ENOMEM;
+	}
+	bzero(newrefs, sizeof(uint16_t) * npages);
+
+	lock_acquire(swap_mutex);
+
+	if (free_pages != max_pages) {
+		// Pages are swapped out - too late to change it
+		lock_release(swap_mutex);
+		bitmap_destroy(newmap);
+		kfree(newrefs);
+		return EBUSY;
+	}
+
+	struct bitmap* oldmap = swapmap;
+	uint16_t* oldrefs = swaprefs;
+	swapmap = newmap;
+	swaprefs = newrefs;
+	max_pages = npages;
+	free_pages = npages;
+	next_slot = 0;
+
+	lock_release(swap_mutex);
+
+	bitmap_destroy(oldmap);
+	kfree(oldrefs);
+
+	// Nothing is swapped out, so nothing is in the compressed cache
+	return zswap_set_slots(npages);
+}
 
 /*
  * Initialize the swap file. Panic if can't.
@@ -131,10 +464,12 @@ swap_free(uint16_t pageIndex){
 void
 swap_init(void){
 	// initalize swap file table...
-
-	for(int i = 0; i < max_pages; i++){
-		swaptable[i] = true;
+	swapmap = bitmap_create(max_pages);
+	swaprefs = kmalloc(sizeof(uint16_t) * max_pages);
+	if (swapmap == NULL || swaprefs == NULL) {
+		panic("fail to initialize swap table\n");
 	}
+	bzero(swaprefs, sizeof(uint16_t) * max_pages);
 
 	swap_mutex = lock_create("swap_file_lock");
 
@@ -142,9 +477,14 @@ swap_init(void){
 		panic("fail to initialize swap table lock\n");
 	}
 
+	// Swapped out pages go to the compressed cache first
+	zswap_init(max_pages);
+
 	// create file, lazy initialization
 	char* filename = kstrdup(SWAPFILE_NAME);
 	if (filename == NULL) panic("failed to copy swapfile name\n");
+	swap_path = kstrdup(SWAPFILE_NAME);
+	if (swap_path == NULL) panic("failed to copy swapfile name\n");
 
 	// Open the file
 	int result = vfs_open(filename, O_RDWR | O_CREAT, 0, &swap_vn);
@@ -153,14 +493,187 @@ swap_init(void){
 	}
 }
 
+/*
+	swap to path instead: a file, or a raw disk device such as
+	"lhd1raw:" (anything ending in a colon), which is then used whole
+	and only for swap. only allowed while nothing is swapped out
+*/
+int
+swap_setdev(const char* path){
+	size_t len = strlen(path);
+	if (len == 0) return EINVAL;
+	bool raw = (path[len - 1] == ':');
+
+	char* newpath = kstrdup(path);
+	// vfs_open may change the string it is given
+	char* name = kstrdup(path);
+	if (newpath == NULL || name == NULL) {
+		kfree(newpath);
+		kfree(name);
+		return ENOMEM;
+	}
+
+	struct vnode* vn;
+	int result = vfs_open(name, raw ? O_RDWR : O_RDWR | O_CREAT, 0, &vn);
+	kfree(name);
+	if (result) {
+		kfree(newpath);
+		return result;
+	}
+
+	unsigned dev_pages = 0;
+	if (raw) {
+		struct stat st;
+		result = VOP_STAT(vn, &st);
+		if (result == 0 && st.st_size < PAGE_SIZE) result = EINVAL;
+		if (result) {
+			vfs_close(vn);
+			kfree(newpath);
+			return result;
+		}
+		dev_pages = st.st_size / PAGE_SIZE;
+	}
+
+	// Only whole slots of the device are used
+	unsigned old_dev_pages = swap_dev_pages;
+	swap_dev_pages = 0;
+	result = raw ? swap_resize(dev_pages) : 0;
+	lock_acquire(swap_mutex);
+	if (result == 0 && free_pages != max_pages) {
+		// Pages are swapped out - too late to change it
+		result = EBUSY;
+	}
+	if (result) {
+		swap_dev_pages = old_dev_pages;
+		lock_release(swap_mutex);
+		vfs_close(vn);
+		kfree(newpath);
+		return result;
+	}
+
+	struct vnode* oldvn = swap_vn;
+	char* oldpath = swap_path;
+	swap_vn = vn;
+	swap_path = newpath;
+	swap_dev_pages = dev_pages;
+	lock_release(swap_mutex);
+
+	vfs_close(oldvn);
+	kfree(oldpath);
+	kprintf("swap: using %s (%u pages)\n", swap_path, max_pages);
+	return 0;
+}
+
+/*
+	microseconds since the time in secs and nsecs
+*/
+static
+uint32_t
+swap_bench_usecs(time_t secs, uint32_t nsecs){
+	time_t now_secs;
+	uint32_t now_nsecs;
+	gettime(&now_secs, &now_nsecs);
+
+	return (now_secs - secs) * 1000000 + (now_nsecs / 1000) - (nsecs / 1000);
+}
+
+/*
+	print how long one pass over npages pages took
+*/
+static
+void
+swap_bench_report(const char* what, unsigned npages, uint32_t usecs){
+	uint32_t msecs = (usecs < 1000) ? 1 : usecs / 1000;
+	kprintf("swapbench: %s %u pages in %u.%03u s (%u KB/s)\n", what, npages,
+		usecs / 1000000, (usecs / 1000) % 1000,
+		npages * (PAGE_SIZE / 1024) * 1000 / msecs);
+}
+
+/*
+	time writing npages pages out to swap, in clusters of SWAP_CLUSTER
+	pages, and reading them back in. goes straight to the swap file (or
+	device), without the compressed cache, so that backends can be
+	compared (see swap_setdev)
+*/
+int
+swap_bench(unsigned npages){
+	if (npages == 0) return EINVAL;
+
+	paddr_t paddrs[SWAP_CLUSTER];
+	for (unsigned i = 0; i < SWAP_CLUSTER; ++i) {
+		vaddr_t page = alloc_kpages(1);
+		if (page == 0) {
+			for (unsigned j = 0; j < i; ++j) {
+				free_kpages(PADDR_TO_KVADDR(paddrs[j]));
+			}
+			return ENOMEM;
+		}
+		// Something other than zeros, in case that matters to a device
+		uint32_t* words = (uint32_t*)page;
+		for (unsigned w = 0; w < PAGE_SIZE / sizeof(uint32_t); ++w) {
+			words[w] = 0xa5a5a5a5 ^ (i * PAGE_SIZE + w);
+		}
+		paddrs[i] = KVADDR_TO_PADDR(page);
+	}
+
+	uint32_t start;
+	lock_acquire(swap_mutex);
+	int result = swap_alloc_extent(npages, &start);
+	lock_release(swap_mutex);
+	bool reserved = (result == 0);
+
+	time_t secs;
+	uint32_t nsecs;
+	uint32_t usecs;
+	if (result == 0) {
+		gettime(&secs, &nsecs);
+		for (unsigned done = 0; result == 0 && done < npages;
+				done += SWAP_CLUSTER) {
+			unsigned n = (npages - done < SWAP_CLUSTER) ?
+				npages - done : SWAP_CLUSTER;
+			result = swap_disk_io(start + done, paddrs, n, UIO_WRITE);
+		}
+		usecs = swap_bench_usecs(secs, nsecs);
+		if (result == 0) swap_bench_report("wrote", npages, usecs);
+	}
+
+	if (result == 0) {
+		gettime(&secs, &nsecs);
+		for (unsigned done = 0; result == 0 && done < npages;
+				done += SWAP_CLUSTER) {
+			unsigned n = (npages - done < SWAP_CLUSTER) ?
+				npages - done : SWAP_CLUSTER;
+			result = swap_disk_io(start + done, paddrs, n, UIO_READ);
+		}
+		usecs = swap_bench_usecs(secs, nsecs);
+		if (result == 0) swap_bench_report("read", npages, usecs);
+	}
+
+	if (reserved) {
+		lock_acquire(swap_mutex);
+		for (unsigned i = 0; i < npages; ++i) {
+			swap_release(start + i);
+		}
+		lock_release(swap_mutex);
+	}
+
+	for (unsigned i = 0; i < SWAP_CLUSTER; ++i) {
+		free_kpages(PADDR_TO_KVADDR(paddrs[i]));
+	}
+	return result;
+}
+
 /*
 	when program exits
 */
 void
 swap_destroy(void){
 	vfs_close(swap_vn);
+	kfree(swap_path);
 	// else the swap file was never in use
 	lock_destroy(swap_mutex);
+	bitmap_destroy(swapmap);
+	kfree(swaprefs);
 }
 
 #endif
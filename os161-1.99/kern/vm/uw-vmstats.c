@@ -15,6 +15,7 @@
 #include <synch.h>
 #include <spl.h>
 #include <uw-vmstats.h>
+#include <vm.h>
 
 /* Counters for tracking statistics */
 static unsigned int stats_counts[VMSTAT_COUNT];
@@ -33,6 +34,36 @@ static const char *stats_names[] = {
  /*  7 */ "Page Faults from ELF",
  /*  8 */ "Page Faults from Swapfile",
  /*  9 */ "Swapfile Writes",
+ /* 10 */ "Copy-on-write Faults",
+ /* 11 */ "Shared Text Hits",
+ /* 12 */ "Swap Cluster Writes",
+ /* 13 */ "Swap Cluster Pages Out",
+ /* 14 */ "Swap Cluster Reads",
+ /* 15 */ "Swap Readahead Pages",
+ /* 16 */ "Pageout Thread Cleans",
+ /* 17 */ "Pageout Thread Evictions",
+ /* 18 */ "Fault-around Pages",
+ /* 19 */ "Prefetched Pages Used",
+ /* 20 */ "Heap Page Faults",
+ /* 21 */ "Heap Pages Released",
+ /* 22 */ "Mmap Page Writebacks",
+ /* 23 */ "Zero Page Mappings",
+ /* 24 */ "Zero Page Copies",
+ /* 25 */ "Zeroed Frame Pool Hits",
+ /* 26 */ "Zeroed Frame Pool Misses",
+ /* 27 */ "Zswap Pages Stored",
+ /* 28 */ "Zswap Compressed Bytes",
+ /* 29 */ "Zswap Pages Rejected",
+ /* 30 */ "Zswap Hits",
+ /* 31 */ "Zswap Misses",
+ /* 32 */ "Zswap Writebacks",
+ /* 33 */ "Local Page Replacements",
+ /* 34 */ "Out-of-Memory Kills",
+ /* 35 */ "Compaction Runs",
+ /* 36 */ "Compaction Pages Migrated",
+ /* 37 */ "Compaction Failures",
+ /* 38 */ "Mmap Pages Lost Past EOF",
+ /* 39 */ "TLB Shootdowns Sent",
 };
 
 
@@ -46,6 +77,16 @@ vmstats_inc(unsigned int index)
     spinlock_release(&stats_lock);
 }
 
+/* ---------------------------------------------------------------------- */
+/* Assumes vmstat_init has already been called */
+void
+vmstats_add(unsigned int index, unsigned int amount)
+{
+    spinlock_acquire(&stats_lock);
+      _vmstats_add(index, amount);
+    spinlock_release(&stats_lock);
+}
+
 /* ---------------------------------------------------------------------- */
 void
 vmstats_init(void)
@@ -68,6 +109,14 @@ _vmstats_inc(unsigned int index)
   stats_counts[index]++;
 }
 
+/* ---------------------------------------------------------------------- */
+void
+_vmstats_add(unsigned int index, unsigned int amount)
+{
+  KASSERT(index < VMSTAT_COUNT);
+  stats_counts[index] += amount;
+}
+
 /* ---------------------------------------------------------------------- */
 void
 _vmstats_init(void)
@@ -102,6 +151,8 @@ vmstats_print(void)
   int tlb_faults = 0;
   int elf_plus_swap_reads = 0;
   int disk_reads = 0;
+  int zswap_stored = 0;
+  int zswap_loads = 0;
 
   kprintf("VMSTATS:\n");
   for (i=0; i<VMSTAT_COUNT; i++) {
@@ -133,5 +184,17 @@ vmstats_print(void)
     kprintf("WARNING: ELF File reads + Swapfile reads != Page Faults (Disk) %d\n",
       elf_plus_swap_reads);
   }
+
+  zswap_stored = stats_counts[VMSTAT_ZSWAP_STORE];
+  zswap_loads = stats_counts[VMSTAT_ZSWAP_HIT] + stats_counts[VMSTAT_ZSWAP_MISS];
+  if (zswap_stored > 0) {
+    kprintf("VMSTAT Zswap average compressed page = %d bytes (%d%% of a page)\n",
+      stats_counts[VMSTAT_ZSWAP_BYTES] / zswap_stored,
+      (stats_counts[VMSTAT_ZSWAP_BYTES] / zswap_stored) * 100 / PAGE_SIZE);
+  }
+  if (zswap_loads > 0) {
+    kprintf("VMSTAT Zswap hit rate = %d%%\n",
+      stats_counts[VMSTAT_ZSWAP_HIT] * 100 / zswap_loads);
+  }
 }
 /* ---------------------------------------------------------------------- */
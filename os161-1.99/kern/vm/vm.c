@@ -23,7 +23,11 @@
 #include <uw-vmstats.h>
 #include <pt.h>
 #include <coremap.h>
+#include <oom.h>
 #include <segments.h>
+#include <cpu.h>
+#include <thread.h>
+#include <platform/maxcpus.h>
 
 //recored is the coremap set up
 static bool coremap_set_up = false;
@@ -43,12 +47,37 @@ getppages(unsigned long npages)
 	return addr;
 }
 
+// TLB address space IDs. An address space gets an ASID from the current
+// generation when it runs; once they are all taken a new generation
+// starts, and each CPU flushes its TLB before it uses an ASID from it.
+// ASID 0 is never handed out.
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static unsigned asid_generation = 1;
+static unsigned asid_next = 1;
+// the generation each CPU's TLB is from, and the ASID it is using
+static unsigned asid_cpu_generation[MAXCPUS];
+static unsigned asid_cpu_current[MAXCPUS];
+// each CPU that has run an address space, to send TLB shootdowns to
+static struct cpu* asid_cpus[MAXCPUS];
+
 static unsigned int next_victim = 0;
 
+// Every TLB slot below this one is in use on the CPU (see tlb_insert)
+static unsigned tlb_free_hint[MAXCPUS];
+
 void reset_next_victim(void){
 	next_victim = 0;
 }
 
+/*
+ * Every TLB operation overwrites c0_entryhi, which also holds the ASID
+ * that translations are matched against: put the current one back.
+ * Call with interrupts off.
+ */
+static void tlb_restore_pid(void){
+	tlb_setentryhi(asid_cpu_current[curcpu->c_number] << TLBHI_PIDSHIFT);
+}
+
 static int tlb_get_rr_victim(void){
 	int victim;
 
@@ -57,6 +86,66 @@ static int tlb_get_rr_victim(void){
 	return victim;
 
 }
+
+/*
+ * Find the page table entry for vaddr in the software TLB of as.
+ */
+static inline struct pte*
+stlb_lookup(struct addrspace* as, vaddr_t vaddr) {
+	struct stlb_entry* e = &as->as_stlb[(vaddr / PAGE_SIZE) % AS_STLB_SIZE];
+	return e->tag == vaddr ? e->pte : NULL;
+}
+
+static inline void
+stlb_fill(struct addrspace* as, vaddr_t vaddr, struct pte* pte) {
+	struct stlb_entry* e = &as->as_stlb[(vaddr / PAGE_SIZE) % AS_STLB_SIZE];
+	e->tag = vaddr;
+	e->pte = pte;
+}
+
+/*
+ * Refill the TLB for a page that is already in memory, using the page
+ * table entry from the software TLB. Returns false if the entry isn't
+ * cached, or if the fault needs more than a refill (the page is not
+ * loaded, or this is the first write to it); vm_fault handles those.
+ */
+static bool
+vm_fault_reload(int faulttype, vaddr_t vaddr, struct addrspace* as) {
+	struct pte* pte = stlb_lookup(as, vaddr);
+	if (pte == NULL) return false;
+
+	paddr_t paddr = pte->paddr;
+	if ((paddr & PT_VALID) == 0) return false;
+
+	uint32_t tlb_lo = (paddr & PAGE_FRAME) | TLBLO_VALID;
+	if ((paddr & PT_DIRTY) && !coremaps_is_shared(paddr & PAGE_FRAME)) {
+		tlb_lo |= TLBLO_DIRTY;
+	}
+	else if (faulttype == VM_FAULT_WRITE) {
+		return false;
+	}
+
+	vmstats_inc(VMSTAT_TLB_FAULT);
+	vmstats_inc(VMSTAT_TLB_RELOAD);
+	if (paddr & PT_PREFETCH) {
+		// First use of a page that was read ahead
+		pte->paddr &= ~PT_PREFETCH;
+		vmstats_inc(VMSTAT_PREFETCH_USED);
+	}
+
+	tlb_insert(vaddr | (as->as_asid << TLBHI_PIDSHIFT), tlb_lo);
+	coremaps_reference(paddr & PAGE_FRAME);
+	return true;
+}
+
+/*
+ * A fault could not get a frame: have the OOM killer make room. Returns
+ * 0 to retry the access, or ENOMEM if this process is the one to die.
+ */
+static int
+vm_fault_oom(void) {
+	return oom_kill() ? 0 : ENOMEM;
+}
 #endif /* OPT-A3 */
 
 void
@@ -119,7 +208,11 @@ vm_tlbshootdown_all(void)
 	for (int i=0; i<NUM_TLB; i++) {
 		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
 	}
+	#if OPT_A3
+	tlb_free_hint[curcpu->c_number] = 0;
+	#endif /* OPT_A3 */
 
+	tlb_restore_pid();
 	splx(spl);
 }
 
@@ -127,33 +220,39 @@ void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
 	int spl = splhigh();
-	uint32_t hi = ts->ts_vaddr;
+	uint32_t hi = ts->ts_vaddr | (ts->ts_asid << TLBHI_PIDSHIFT);
 	int index = tlb_probe(hi,0);
 	if(index >= 0){
 		tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+		#if OPT_A3
+		unsigned cpu = curcpu->c_number;
+		if ((unsigned)index < tlb_free_hint[cpu]) {
+			tlb_free_hint[cpu] = index;
+		}
+		#endif /* OPT_A3 */
 	}
+	tlb_restore_pid();
 	splx(spl);
 	// else discard
 	
 }
 
 int
-vm_fault(int faulttype, vaddr_t faultaddress)
+vm_fault(int faulttype, vaddr_t faultaddress, vaddr_t stackptr)
 {
 
 	#if OPT_A3
 
 	paddr_t paddr;
-	uint16_t swap_offset;
-	struct pte PTE;
+	uint32_t swap_offset;
+	struct pte* pte;
 	struct addrspace *as;
 
 	faultaddress &= PAGE_FRAME;
 
 	switch (faulttype) {
 		case VM_FAULT_READONLY:
-			// read-only - error
-			return 1;
+			// write to a page that is mapped read-only (see below)
 		case VM_FAULT_READ:
 		case VM_FAULT_WRITE:
 			break;
@@ -172,22 +271,97 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
-	seg_type segment_type;
-	int result = get_seg_type(faultaddress, as, &segment_type);
+	// Most faults are refills of pages that are already loaded
+	if (faulttype != VM_FAULT_READONLY &&
+			vm_fault_reload(faulttype, faultaddress, as)) {
+		return 0;
+	}
+
+	struct segment* seg = seg_find(as, faultaddress);
+	if (seg == NULL) {
+		// Just below the stack? Then it grows down to cover it
+		int result = as_grow_stack(as, faultaddress, stackptr);
+		if (result) return result;
+		seg = as->as_stack;
+	}
+	seg_type segment_type = seg->type;
+
+	// Is this access going to modify the page?
+	bool write = (faulttype != VM_FAULT_READ);
+
+	// Text segment (and read only mappings) are not writeable
+	if (write && !seg_writeable(seg)) return EFAULT;
+
+	int result = pt_alloc(faultaddress, as, &pte);
 	if (result) return result;
+	stlb_fill(as, faultaddress, pte);
+
+	// Shared file mappings write to the shared frame itself
+	bool shared_file = seg_shared_file(seg);
+
+	if (write && !shared_file && (pte->paddr & PT_VALID) &&
+			coremaps_is_shared(pte->paddr & PAGE_FRAME)) {
+		// Shared with a parent or child since fork: get a private copy.
+		// The access is retried and faults in the new mapping.
+		as->as_faults++;
+		result = coremaps_cow(as, faultaddress);
+		return (result == ENOMEM) ? vm_fault_oom() : result;
+	}
+
+	if (faulttype == VM_FAULT_READONLY && (pte->paddr & PT_VALID)) {
+		// Pages are mapped without TLBLO_DIRTY until the first write,
+		// so that clean pages can be evicted without writing them to
+		// swap. This is that first write: remember it and let it through.
+		pte->paddr |= PT_DIRTY;
+		paddr = pte->paddr & PAGE_FRAME;
+		tlb_update(faultaddress | (as->as_asid << TLBHI_PIDSHIFT),
+			paddr | TLBLO_VALID | TLBLO_DIRTY);
+		coremaps_reference(paddr);
+		return 0;
+	}
 
 	// True if the page is a new one (wasn't in page table)
 	bool newPage = false;
 
+	// Offset of the page in its file (only used for cached pages)
+	off_t file_offset = seg->file_offset + (faultaddress - seg->vbase);
+
+	if ((pte->paddr & PT_VALID) == 0 && seg_cached(seg) &&
+			coremaps_text_share(as, faultaddress, seg->vn, file_offset)) {
+		// Another process running this program (or mapping this file)
+		// has the page loaded
+		vmstats_inc(VMSTAT_TEXT_SHARED);
+	}
+
+	if ((pte->paddr & PT_VALID) == 0 && !write &&
+			pte->swap_offset == PT_NO_SWAP &&
+			seg_demand_zero(seg, faultaddress)) {
+		// Reading a page that would be zero filled: map the shared zero
+		// frame read only. The first write gets a private frame for it
+		// (see coremaps_cow), so pages that are only read cost nothing.
+		paddr = coremaps_zero_share(as, faultaddress);
+		as->as_faults++;
+		vmstats_inc(VMSTAT_TLB_FAULT);
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+		vmstats_inc(VMSTAT_ZERO_PAGE_MAP);
+		if (segment_type == HEAP) vmstats_inc(VMSTAT_HEAP_FAULT);
+
+		tlb_insert(faultaddress | (as->as_asid << TLBHI_PIDSHIFT),
+			paddr | TLBLO_VALID);
+		return 0;
+	}
+
 	// get the paddr
-	result = pt_getEntry(faultaddress, &PTE);
-	paddr = PTE.paddr;
-	swap_offset = PTE.swap_offset;
+	paddr = pte->paddr;
+	swap_offset = pte->swap_offset;
 
 	if((paddr & PT_VALID) == 0){
 		newPage = true;
-		// Not loaded in page table yet - load it up
-		paddr = coremaps_getppages(1, as, faultaddress); // new physical page
+		as->as_faults++;
+		// Not loaded in page table yet - load it up. The frame is busy
+		// until it is loaded, so it can't be evicted or shared before.
+		paddr = coremaps_fault_alloc(as, faultaddress);
+		if (paddr == 0) return vm_fault_oom();
 
 		// Update page table with this vaddr
 		result = pt_setEntry(faultaddress, paddr);
@@ -195,12 +369,26 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		// space because load page may take a will -> yield cpu to other
 		// process
 		if (result) {
-			// free page ? probably...
+			coremaps_fault_done(as, faultaddress, paddr, false);
 			return result;
 		}
+
+		if (seg_cached(seg) && swap_offset == PT_NO_SWAP &&
+				!coremaps_text_publish(as, faultaddress, paddr, seg->vn,
+					file_offset)) {
+			// Another process started loading it since we looked: give
+			// ours back, and retry the access, which waits for theirs
+			coremaps_fault_done(as, faultaddress, paddr, false);
+			return 0;
+		}
 	}
 	else {
 		vmstats_inc(VMSTAT_TLB_RELOAD);
+		if (paddr & PT_PREFETCH) {
+			// First use of a page that was read ahead
+			pte->paddr &= ~PT_PREFETCH;
+			vmstats_inc(VMSTAT_PREFETCH_USED);
+		}
 		// Get the actual *address* and ignore the flags from page table
 		paddr &= PAGE_FRAME;
 	}
@@ -210,31 +398,41 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	vmstats_inc(VMSTAT_TLB_FAULT);
 
+	// Only a page that has been written may be mapped writeable
+	if (write) pte->paddr |= PT_DIRTY;
+
 	uint32_t tlb_hi, tlb_lo;
-	tlb_hi = faultaddress;
+	tlb_hi = faultaddress | (as->as_asid << TLBHI_PIDSHIFT);
 	tlb_lo = paddr | TLBLO_VALID;
-	// Text segment is not writeable
-	if (segment_type != TEXT) tlb_lo |= TLBLO_DIRTY;
-
-	// Insert into the tlb (choose the index for us)
-	tlb_insert(tlb_hi, tlb_lo);
+	// Shared frames stay read only until they are copied
+	if ((pte->paddr & PT_DIRTY) &&
+			(shared_file || !coremaps_is_shared(paddr))) {
+		tlb_lo |= TLBLO_DIRTY;
+	}
 
 	if (newPage) {
-		// Load the page into memory - it is a new page
+		// Load the page into memory - it is a new page. It only goes in
+		// the TLB once it is loaded.
 		// TODO: Do not pass swap_offset here
 		result = pt_loadPage(faultaddress, paddr, swap_offset, as, segment_type);
-
 		if (result) {
-			// Invalidate TLB and page table entries?
+			coremaps_fault_done(as, faultaddress, paddr, false);
 			return result;
 		}
-		// TODO: Update TLB and page table here, or above?
-		// ... it might be better to do it here.
-		// one thing to think about: can we swap out the physical page
-		// in between then and now?  I seriously doubt it.
-		// Maybe put in a check when choosing a page to swap to check if
-		// the page has been loaded, and only swap those that have?
+
+		if (segment_type == HEAP) {
+			vmstats_inc(VMSTAT_HEAP_FAULT);
+		}
 	}
+
+	// Insert into the tlb (choose the index for us)
+	tlb_insert(tlb_hi, tlb_lo);
+	// Let the page replacement policy know this page is in use
+	coremaps_reference(paddr);
+
+	// Only now may a new page be evicted, since evicting it is what drops
+	// the TLB entry again
+	if (newPage) coremaps_fault_done(as, faultaddress, paddr, true);
 	return 0;
 
 	#else
@@ -259,9 +457,10 @@ tlb_insert(uint32_t tlb_hi, uint32_t tlb_lo) {
 	int index;
 	// No interrupts while messing with TLB
 	int spl = splhigh();
+	unsigned cpu = curcpu->c_number;
 
-	//if there exists free TLB entry
-	for (index = 0; index < NUM_TLB; index++) {
+	//if there exists free TLB entry (none below the hint)
+	for (index = tlb_free_hint[cpu]; index < NUM_TLB; index++) {
 		tlb_read(&ehi, &elo, index);
 		if (elo & TLBLO_VALID) {
 			continue;
@@ -270,18 +469,149 @@ tlb_insert(uint32_t tlb_hi, uint32_t tlb_lo) {
 		vmstats_inc(VMSTAT_TLB_FAULT_FREE);
 
 		tlb_write(tlb_hi, tlb_lo, index);
+		tlb_free_hint[cpu] = index + 1;
+		tlb_restore_pid();
 		splx(spl);
 		return index;
 	}
 
 	// RR replacement in TLB
+	tlb_free_hint[cpu] = NUM_TLB;
 	vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
 	index = tlb_get_rr_victim();
 
 	tlb_write(tlb_hi, tlb_lo, index);
+	tlb_restore_pid();
 	splx(spl);
 	return index;
 }
+
+/*
+ * tlb_update replaces the entry for tlb_hi if it is still in the TLB.
+ * Used to change the permissions of a mapping. If the entry is gone,
+ * the next access refaults and picks it up from the page table anyway.
+ */
+void
+tlb_update(uint32_t tlb_hi, uint32_t tlb_lo) {
+	// No interrupts while messing with TLB
+	int spl = splhigh();
+
+	int index = tlb_probe(tlb_hi, 0);
+	if (index >= 0) {
+		tlb_write(tlb_hi, tlb_lo, index);
+	}
+	tlb_restore_pid();
+	splx(spl);
+}
+
+/*
+ * Have another CPU drop a TLB entry, and wait until it has: the caller
+ * is about to reuse the frame, or take away write access to it.
+ */
+static
+void
+tlb_shootdown_remote(struct cpu* target, const struct tlbshootdown* tlbs) {
+	// The target may be waiting for a shootdown from us as well, so we
+	// have to be able to take one while we wait
+	KASSERT(curthread->t_curspl == 0);
+
+	ipi_tlbshootdown(target, tlbs);
+	vmstats_inc(VMSTAT_TLB_SHOOTDOWN);
+
+	// Clear once the target has done every shootdown it was sent
+	bool pending = true;
+	while (pending) {
+		spinlock_acquire(&target->c_ipi_lock);
+		pending = (target->c_ipi_pending & (1U << IPI_TLBSHOOTDOWN)) != 0;
+		spinlock_release(&target->c_ipi_lock);
+	}
+}
+
+/*
+ * Remove the TLB entry for vaddr in the given address space, if it
+ * could be there. Entries are tagged with ASIDs, so this works for
+ * address spaces that are not running too.
+ */
+void
+tlb_invalidate(vaddr_t vaddr, struct addrspace* as) {
+	struct tlbshootdown tlbs;
+	tlbs.ts_addrspace = as;
+	tlbs.ts_vaddr = vaddr & PAGE_FRAME;
+
+	int spl = splhigh();
+
+	// Only this CPU's TLB can be checked directly. If as is running on
+	// another CPU (its ASID is the one in use there), that CPU has to
+	// drop the entry itself. If it only ran there last, it takes a new
+	// ASID when it runs again, so whatever it left in that CPU's TLB is
+	// never used again.
+	spinlock_acquire(&asid_lock);
+	unsigned cpu = as->as_asid_cpu;
+	bool current = as->as_asid_gen == asid_generation;
+	bool here = current && cpu == curcpu->c_number;
+	bool running = current && !here && asid_cpu_current[cpu] == as->as_asid;
+	if (!here && !running) as->as_asid_gen = 0;
+	tlbs.ts_asid = as->as_asid;
+	spinlock_release(&asid_lock);
+
+	if (here) vm_tlbshootdown(&tlbs);
+	splx(spl);
+
+	if (running) tlb_shootdown_remote(asid_cpus[cpu], &tlbs);
+}
+
+/*
+ * Make this CPU translate with the ASID of as. It gets a new ASID if it
+ * has none from the current generation, or if it ran on another CPU
+ * last (it may have left entries there that we can't invalidate).
+ */
+void
+tlb_activate(struct addrspace* as) {
+	int spl = splhigh();
+	unsigned cpu = curcpu->c_number;
+
+	spinlock_acquire(&asid_lock);
+	if (as->as_asid_gen != asid_generation || as->as_asid_cpu != cpu) {
+		if (asid_next == NUM_ASID) {
+			// All taken - start reusing them
+			asid_generation += 1;
+			asid_next = 1;
+		}
+		as->as_asid = asid_next;
+		as->as_asid_gen = asid_generation;
+		as->as_asid_cpu = cpu;
+		asid_next += 1;
+	}
+	bool flush = asid_cpu_generation[cpu] != asid_generation;
+	asid_cpu_generation[cpu] = asid_generation;
+	asid_cpu_current[cpu] = as->as_asid;
+	asid_cpus[cpu] = curcpu->c_self;
+	spinlock_release(&asid_lock);
+
+	if (flush) {
+		// The TLB may have entries with the ASIDs of the last
+		// generation, which are being handed out again
+		vm_tlbshootdown_all();
+		vmstats_inc(VMSTAT_TLB_INVALIDATE);
+		reset_next_victim();
+	}
+	tlb_restore_pid();
+	splx(spl);
+}
+
+/*
+ * Drop every TLB entry of as, by giving it a new ASID.
+ */
+void
+tlb_flush_as(struct addrspace* as) {
+	spinlock_acquire(&asid_lock);
+	as->as_asid_gen = 0;
+	spinlock_release(&asid_lock);
+
+	if (curproc != NULL && curproc_getas() == as) {
+		tlb_activate(as);
+	}
+}
 #endif /* OPT_A3 */
 
 #endif /* OPT_VM */
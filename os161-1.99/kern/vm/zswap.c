@@ -0,0 +1,499 @@
+#include "opt-A3.h"
+#if OPT_A3
+#include <types.h>
+#include <lib.h>
+#include <kern/errno.h>
+#include <synch.h>
+#include <vm.h>
+#include <uw-vmstats.h>
+#include <coremap.h>
+#include <swapfile.h>
+#include <zswap.h>
+
+// The store is made of frames split into chunks. A compressed page takes
+// a run of chunks within one frame; each frame has one bit per chunk in
+// zs_used.
+#define ZS_CHUNK_SIZE 128
+#define ZS_CHUNKS (PAGE_SIZE / ZS_CHUNK_SIZE)
+
+// zs_start of a slot that has nothing in the store
+#define ZS_NONE 0xffffffff
+
+// pages written back to the swap file to make room for one new page,
+// at most
+#define ZS_WRITEBACK_TRIES 4
+
+// Compressed format: a control byte, followed by either 1 to 128 literal
+// bytes (control < 0x80), or by a two byte offset back into the page for
+// a match of (control & 0x7f) + ZS_MIN_MATCH bytes.
+#define ZS_MIN_MATCH 4
+#define ZS_MAX_MATCH (0x7f + ZS_MIN_MATCH)
+#define ZS_MAX_LITERALS 0x80
+
+// Matches are found through a hash of the next ZS_MIN_MATCH bytes
+#define ZS_HASH_BITS 10
+#define ZS_HASH_SIZE (1 << ZS_HASH_BITS)
+#define ZS_HASH_EMPTY 0xffff
+
+static struct lock* zs_lock = NULL;
+
+// frames in the store (0 if it is turned off), and their kernel addresses
+static unsigned zs_npages = 0;
+static vaddr_t* zs_frames = NULL;
+// chunks in use in each frame, one bit each
+static uint32_t* zs_used = NULL;
+// frame to look in first
+static unsigned zs_next_frame = 0;
+
+// for each swap slot: the first chunk of its page (frame * ZS_CHUNKS +
+// chunk) or ZS_NONE, and the compressed size
+static unsigned zs_nslots = 0;
+static uint32_t* zs_start = NULL;
+static uint16_t* zs_size = NULL;
+// number of pages in the store
+static unsigned zs_count = 0;
+
+// next slot to look at for a page to write back
+static unsigned zs_hand = 0;
+// page that pages are decompressed into to write them back
+static vaddr_t zs_scratch;
+// slot being written back (ZS_NONE if none), and whether its page was
+// dropped meanwhile. zs_lock is not held during the write; stores to the
+// slot wait on zs_wb_cv until it is done.
+static uint32_t zs_wb_slot = ZS_NONE;
+static bool zs_wb_changed = false;
+static struct cv* zs_wb_cv = NULL;
+
+// compressor state (protected by zs_lock)
+static uint16_t zs_hash[ZS_HASH_SIZE];
+static uint8_t zs_buf[ZSWAP_MAX_SIZE];
+
+static inline
+uint32_t
+zs_read32(const uint8_t* p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*
+ * Copy n literal bytes from src to dst at *op. Returns false if they
+ * don't fit in limit bytes.
+ */
+static
+bool
+zs_literals(const uint8_t* src, size_t n, uint8_t* dst, size_t* op,
+		size_t limit) {
+	while (n > 0) {
+		size_t run = (n < ZS_MAX_LITERALS) ? n : ZS_MAX_LITERALS;
+		if (*op + 1 + run > limit) return false;
+
+		dst[(*op)++] = run - 1;
+		memcpy(dst + *op, src, run);
+		*op += run;
+		src += run;
+		n -= run;
+	}
+	return true;
+}
+
+/*
+ * Compress the page at src into dst (LZ77: literals, and matches with
+ * earlier bytes of the page). Returns the compressed size, or 0 if it
+ * would be more than limit bytes.
+ */
+static
+size_t
+zs_compress(const uint8_t* src, uint8_t* dst, size_t limit) {
+	size_t ip = 0;
+	size_t op = 0;
+	// start of the literals that haven't been copied yet
+	size_t anchor = 0;
+
+	for (unsigned i = 0; i < ZS_HASH_SIZE; ++i) {
+		zs_hash[i] = ZS_HASH_EMPTY;
+	}
+
+	while (ip + ZS_MIN_MATCH <= PAGE_SIZE) {
+		uint32_t seq = zs_read32(src + ip);
+		unsigned h = (seq * 2654435761U) >> (32 - ZS_HASH_BITS);
+		size_t cand = zs_hash[h];
+		zs_hash[h] = ip;
+
+		if (cand == ZS_HASH_EMPTY || zs_read32(src + cand) != seq) {
+			ip += 1;
+			continue;
+		}
+
+		size_t len = ZS_MIN_MATCH;
+		while (ip + len < PAGE_SIZE && len < ZS_MAX_MATCH &&
+				src[cand + len] == src[ip + len]) {
+			len += 1;
+		}
+
+		if (!zs_literals(src + anchor, ip - anchor, dst, &op, limit)) {
+			return 0;
+		}
+		if (op + 3 > limit) return 0;
+
+		size_t offset = ip - cand;
+		dst[op++] = 0x80 | (len - ZS_MIN_MATCH);
+		dst[op++] = offset & 0xff;
+		dst[op++] = offset >> 8;
+
+		ip += len;
+		anchor = ip;
+	}
+
+	if (!zs_literals(src + anchor, PAGE_SIZE - anchor, dst, &op, limit)) {
+		return 0;
+	}
+	return op;
+}
+
+/*
+ * Decompress len bytes at src into the page at dst
+ */
+static
+void
+zs_decompress(const uint8_t* src, size_t len, uint8_t* dst) {
+	size_t ip = 0;
+	size_t op = 0;
+
+	while (ip < len) {
+		unsigned ctl = src[ip++];
+		if (ctl & 0x80) {
+			size_t n = (ctl & 0x7f) + ZS_MIN_MATCH;
+			size_t offset = src[ip] | (src[ip + 1] << 8);
+			ip += 2;
+			KASSERT(offset > 0 && offset <= op && op + n <= PAGE_SIZE);
+
+			// Can overlap the bytes it produces: one at a time
+			for (size_t i = 0; i < n; ++i, ++op) {
+				dst[op] = dst[op - offset];
+			}
+		}
+		else {
+			size_t n = ctl + 1;
+			KASSERT(ip + n <= len && op + n <= PAGE_SIZE);
+
+			memcpy(dst + op, src + ip, n);
+			ip += n;
+			op += n;
+		}
+	}
+	KASSERT(op == PAGE_SIZE);
+}
+
+/*
+ * Kernel address of chunk
+ */
+static
+uint8_t*
+zs_chunk(uint32_t chunk) {
+	KASSERT(chunk / ZS_CHUNKS < zs_npages);
+	return (uint8_t*)zs_frames[chunk / ZS_CHUNKS] +
+		(chunk % ZS_CHUNKS) * ZS_CHUNK_SIZE;
+}
+
+/*
+ * Take a run of nchunks free chunks in one frame. ENOMEM if there is none.
+ */
+static
+int
+zs_alloc(unsigned nchunks, uint32_t* start) {
+	KASSERT(nchunks > 0 && nchunks < ZS_CHUNKS);
+	uint32_t mask = (1U << nchunks) - 1;
+
+	for (unsigned i = 0; i < zs_npages; ++i) {
+		unsigned frame = (zs_next_frame + i) % zs_npages;
+		for (unsigned pos = 0; pos + nchunks <= ZS_CHUNKS; ++pos) {
+			if ((zs_used[frame] & (mask << pos)) != 0) continue;
+
+			zs_used[frame] |= mask << pos;
+			zs_next_frame = frame;
+			*start = frame * ZS_CHUNKS + pos;
+			return 0;
+		}
+	}
+	return ENOMEM;
+}
+
+/*
+ * Give back the run of nchunks chunks at start (see zs_alloc)
+ */
+static
+void
+zs_free(uint32_t start, unsigned nchunks) {
+	uint32_t mask = ((1U << nchunks) - 1) << (start % ZS_CHUNKS);
+	KASSERT((zs_used[start / ZS_CHUNKS] & mask) == mask);
+	zs_used[start / ZS_CHUNKS] &= ~mask;
+}
+
+/*
+ * Free the chunks of the page of slot
+ */
+static
+void
+zs_drop(uint32_t slot) {
+	uint32_t start = zs_start[slot];
+	KASSERT(start != ZS_NONE);
+
+	zs_free(start, DIVROUNDUP(zs_size[slot], ZS_CHUNK_SIZE));
+	zs_start[slot] = ZS_NONE;
+	zs_count -= 1;
+	if (slot == zs_wb_slot) zs_wb_changed = true;
+}
+
+/*
+ * Make room by writing a page from the store to its slot in the swap
+ * file. Slots are handed out in order (next fit), so sweeping over them
+ * tends to find the oldest pages first. zs_lock is released during the
+ * write, so that loads and other stores don't wait for the disk; the
+ * page leaves the store afterwards, unless it was dropped meanwhile.
+ * One page is written back at a time. Returns false if there is nothing
+ * to write back, another writeback is under way, or the write failed.
+ */
+static
+bool
+zs_writeback(void) {
+	if (zs_wb_slot != ZS_NONE) return false;
+
+	for (unsigned i = 0; i < zs_nslots && zs_count > 0; ++i) {
+		uint32_t slot = zs_hand;
+		zs_hand = (zs_hand + 1) % zs_nslots;
+		if (zs_start[slot] == ZS_NONE) continue;
+
+		zs_decompress(zs_chunk(zs_start[slot]), zs_size[slot],
+			(uint8_t*)zs_scratch);
+		zs_wb_slot = slot;
+		zs_wb_changed = false;
+
+		lock_release(zs_lock);
+		int result = swap_disk_write(slot, KVADDR_TO_PADDR(zs_scratch));
+		lock_acquire(zs_lock);
+
+		// Freed (and maybe reused) while we wrote it: that copy is gone
+		// already, and the slot's contents are somebody else's business
+		if (result == 0 && !zs_wb_changed) zs_drop(slot);
+		zs_wb_slot = ZS_NONE;
+		cv_broadcast(zs_wb_cv, zs_lock);
+		if (result) return false;
+
+		vmstats_inc(VMSTAT_ZSWAP_WRITEBACK);
+		return true;
+	}
+	return false;
+}
+
+bool
+zswap_store(uint32_t slot, paddr_t paddr) {
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	lock_acquire(zs_lock);
+	if (zs_npages == 0 || slot >= zs_nslots) {
+		lock_release(zs_lock);
+		return false;
+	}
+
+	// Our page must not go to the disk before the old one being written
+	// back there does
+	while (zs_wb_slot == slot) cv_wait(zs_wb_cv, zs_lock);
+
+	// The old contents of the slot are being replaced
+	if (zs_start[slot] != ZS_NONE) zs_drop(slot);
+
+	size_t size = zs_compress((const uint8_t*)PADDR_TO_KVADDR(paddr), zs_buf,
+		ZSWAP_MAX_SIZE);
+	uint32_t start;
+	bool stored = false;
+	if (size > 0) {
+		unsigned nchunks = DIVROUNDUP(size, ZS_CHUNK_SIZE);
+		int result = zs_alloc(nchunks, &start);
+		unsigned tries;
+		for (tries = 0; result && tries < ZS_WRITEBACK_TRIES &&
+				zs_writeback(); ++tries) {
+			result = zs_alloc(nchunks, &start);
+		}
+		stored = (result == 0);
+
+		// Another store may have used zs_buf while zs_writeback had
+		// the lock released. Compress again; if the page changed size
+		// meanwhile, it goes to the disk after all.
+		if (stored && tries > 0) {
+			size = zs_compress((const uint8_t*)PADDR_TO_KVADDR(paddr),
+				zs_buf, ZSWAP_MAX_SIZE);
+			if (size == 0 || DIVROUNDUP(size, ZS_CHUNK_SIZE) != nchunks) {
+				zs_free(start, nchunks);
+				stored = false;
+			}
+		}
+	}
+
+	if (!stored) {
+		// Doesn't compress well, or no room even after writing back
+		vmstats_inc(VMSTAT_ZSWAP_REJECT);
+		lock_release(zs_lock);
+		return false;
+	}
+
+	memcpy(zs_chunk(start), zs_buf, size);
+	zs_start[slot] = start;
+	zs_size[slot] = size;
+	zs_count += 1;
+
+	vmstats_inc(VMSTAT_ZSWAP_STORE);
+	vmstats_add(VMSTAT_ZSWAP_BYTES, size);
+
+	lock_release(zs_lock);
+	return true;
+}
+
+bool
+zswap_load(uint32_t slot, paddr_t paddr) {
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	lock_acquire(zs_lock);
+	if (zs_npages == 0 || slot >= zs_nslots) {
+		lock_release(zs_lock);
+		return false;
+	}
+
+	if (zs_start[slot] == ZS_NONE) {
+		vmstats_inc(VMSTAT_ZSWAP_MISS);
+		lock_release(zs_lock);
+		return false;
+	}
+
+	// The store keeps its copy: the page table still refers to the slot
+	// for as long as the page stays clean
+	zs_decompress(zs_chunk(zs_start[slot]), zs_size[slot],
+		(uint8_t*)PADDR_TO_KVADDR(paddr));
+	vmstats_inc(VMSTAT_ZSWAP_HIT);
+
+	lock_release(zs_lock);
+	return true;
+}
+
+void
+zswap_invalidate(uint32_t slot) {
+	lock_acquire(zs_lock);
+	if (slot < zs_nslots && zs_start[slot] != ZS_NONE) {
+		zs_drop(slot);
+	}
+	lock_release(zs_lock);
+}
+
+int
+zswap_set_slots(unsigned nslots) {
+	// Allocate before taking the lock: kmalloc may have to swap
+	uint32_t* start = kmalloc(sizeof(uint32_t) * nslots);
+	uint16_t* size = kmalloc(sizeof(uint16_t) * nslots);
+	if (start == NULL || size == NULL) {
+		kfree(start);
+		kfree(size);
+		return ENOMEM;
+	}
+	for (unsigned i = 0; i < nslots; ++i) {
+		start[i] = ZS_NONE;
+		size[i] = 0;
+	}
+
+	lock_acquire(zs_lock);
+	if (zs_count > 0) {
+		lock_release(zs_lock);
+		kfree(start);
+		kfree(size);
+		return EBUSY;
+	}
+
+	uint32_t* oldstart = zs_start;
+	uint16_t* oldsize = zs_size;
+	zs_start = start;
+	zs_size = size;
+	zs_nslots = nslots;
+	zs_hand = 0;
+	lock_release(zs_lock);
+
+	kfree(oldstart);
+	kfree(oldsize);
+	return 0;
+}
+
+/*
+ * Free the frames of a store
+ */
+static
+void
+zs_free_frames(vaddr_t* frames, uint32_t* used, unsigned npages) {
+	for (unsigned i = 0; i < npages; ++i) {
+		if (frames[i] != 0) free_kpages(frames[i]);
+	}
+	kfree(frames);
+	kfree(used);
+}
+
+int
+zswap_resize(unsigned npages) {
+	vaddr_t* frames = NULL;
+	uint32_t* used = NULL;
+
+	if (npages > 0) {
+		frames = kmalloc(sizeof(vaddr_t) * npages);
+		used = kmalloc(sizeof(uint32_t) * npages);
+		if (frames == NULL || used == NULL) {
+			kfree(frames);
+			kfree(used);
+			return ENOMEM;
+		}
+		bzero(frames, sizeof(vaddr_t) * npages);
+		bzero(used, sizeof(uint32_t) * npages);
+
+		for (unsigned i = 0; i < npages; ++i) {
+			frames[i] = alloc_kpages(1);
+			if (frames[i] == 0) {
+				zs_free_frames(frames, used, npages);
+				return ENOMEM;
+			}
+		}
+	}
+
+	lock_acquire(zs_lock);
+	if (zs_count > 0) {
+		lock_release(zs_lock);
+		if (npages > 0) zs_free_frames(frames, used, npages);
+		return EBUSY;
+	}
+
+	vaddr_t* oldframes = zs_frames;
+	uint32_t* oldused = zs_used;
+	unsigned oldnpages = zs_npages;
+	zs_frames = frames;
+	zs_used = used;
+	zs_npages = npages;
+	zs_next_frame = 0;
+	lock_release(zs_lock);
+
+	if (oldnpages > 0) zs_free_frames(oldframes, oldused, oldnpages);
+	return 0;
+}
+
+void
+zswap_init(unsigned nslots) {
+	zs_lock = lock_create("zswap");
+	zs_wb_cv = cv_create("zswap writeback");
+	if (zs_lock == NULL || zs_wb_cv == NULL) {
+		panic("fail to initialize zswap lock\n");
+	}
+
+	zs_scratch = alloc_kpages(1);
+	if (zs_scratch == 0 || zswap_set_slots(nslots)) {
+		panic("fail to initialize zswap\n");
+	}
+
+	// Not having the store is not fatal, swap just goes to the disk
+	int result = zswap_resize(coremaps_nframes() / ZSWAP_FRACTION);
+	if (result) {
+		kprintf("zswap: no compressed swap cache: %s\n", strerror(result));
+	}
+}
+
+#endif /* OPT_A3 */
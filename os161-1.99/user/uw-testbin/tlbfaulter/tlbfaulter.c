@@ -9,6 +9,9 @@
  *      goal is to force the TLB to be filled quickly, so that TLB
  *      replacements will be necessary.
  *
+ *      Finally it times a longer run of the same loop, in which every
+ *      touch misses in the TLB, and reports the average refill time.
+ *
  *      If this generates "out of memory" errors, you will need
  *      to increase the memory size of the machine (in sys161.conf)
  *      to run this test.
@@ -16,6 +19,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 /* 
  * set these to match the page size of the 
@@ -28,10 +32,15 @@
 #define ArraySize ((TLBSize+5)*PageSize)
 char tlbtest[ArraySize];
 
+/* number of passes over the array in the timed run */
+#define TimedPasses 200
+
 int
 main()
 {
 	int i,j;
+	time_t s0, s1;
+	unsigned long ns0, ns1, elapsed, refills;
 
 	printf("Starting the tlbfaulter program\n");
 
@@ -59,6 +68,22 @@ main()
           }
 	}
 
+	/* time the refills */
+	__time(&s0, &ns0);
+	for(j=0; j<TimedPasses; j++) {
+	  for (i=0; i<ArraySize; i+=PageSize) {
+	    tlbtest[i] += 1;
+	  }
+	}
+	__time(&s1, &ns1);
+
+	/* elapsed microseconds */
+	elapsed = (s1 - s0) * 1000000 + ns1 / 1000 - ns0 / 1000;
+	refills = (unsigned long)TimedPasses * (ArraySize / PageSize);
+	printf("tlbfaulter: %lu refills in %lu us (%lu ns per refill)\n",
+	       refills, elapsed,
+	       elapsed / refills * 1000 + elapsed % refills * 1000 / refills);
+
 	printf("SUCCESS\n");
 	
 	return 0;